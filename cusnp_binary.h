@@ -0,0 +1,147 @@
+#ifndef CUSNP_BINARY_H
+#define CUSNP_BINARY_H
+
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//Binary CuSNP file. Every section starts at an 8 byte aligned offset from the
+//start of the file, so a simulator can mmap the file and index the arrays in
+//place instead of tokenizing the text format.
+//
+//  CuSnpBinaryHeader
+//  int64_t          spikes[neuron_count]               initial configuration
+//  uint64_t         synapse_offsets[neuron_count+1]    CSR row offsets into synapse_targets
+//  int32_t          synapse_targets[synapse_count]     target neuron ids, grouped by source,
+//                                                      -1 for an undeclared neuron
+//  CuSnpBinaryRule  rules[rule_count]                  rule table in declaration order
+//  uint64_t         regex_offsets[regex_count+1]       offsets into regex_data
+//  char             regex_data[]                       NUL terminated interned regexes
+//  uint64_t         progression_offsets[regex_count+1] offsets into progressions
+//  CuSnpBinaryProgression progressions[progression_count]
+//
+//A rule shared by neurons with the same label has one record per neuron. The
+//records of one rule line of the text format are consecutive and carry its
+//index, so the text format can be written back line for line.
+//
+//A regex that is a union of arithmetic progressions of spike counts, such as
+//a*, a5 or a2(a3)*, also has them listed, so it can be matched with integer
+//tests. A regex with none listed has to be matched as a regex.
+
+const char CUSNP_BINARY_MAGIC[8] = {'C', 'U', 'S', 'N', 'P', 'B', 'I', 'N'};
+const uint32_t CUSNP_BINARY_VERSION = 3;
+
+struct CuSnpBinaryHeader{
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint64_t neuron_count;
+  uint64_t rule_count;
+  uint64_t synapse_count;
+  uint64_t regex_count;
+  int64_t simulation_steps;
+  uint64_t spikes_offset;
+  uint64_t synapse_offsets_offset;
+  uint64_t synapse_targets_offset;
+  uint64_t rules_offset;
+  uint64_t regex_offsets_offset;
+  uint64_t regex_data_offset;
+  uint64_t progression_count;
+  uint64_t progression_offsets_offset;
+  uint64_t progressions_offset;
+  uint64_t file_size;
+};
+
+struct CuSnpBinaryRule{
+  int32_t neuron;     //-1 if the rule's neuron was never declared
+  int32_t c;
+  int32_t p;
+  int32_t d;
+  int32_t regex;      //index into the regex table
+  int32_t line;       //rule line of the text format the record belongs to, from 0
+};
+
+//Spike counts offset + period*n for n >= 0, offset alone when period is 0
+struct CuSnpBinaryProgression{
+  int64_t offset;
+  int64_t period;
+};
+
+static_assert(sizeof(CuSnpBinaryHeader) == 136, "CuSnpBinaryHeader layout changed");
+static_assert(sizeof(CuSnpBinaryRule) == 24, "CuSnpBinaryRule layout changed");
+static_assert(sizeof(CuSnpBinaryProgression) == 16, "CuSnpBinaryProgression layout changed");
+
+inline const int64_t* cusnpSpikes(const CuSnpBinaryHeader *header){
+  return (const int64_t*)((const char*)header + header->spikes_offset);
+}
+
+inline const uint64_t* cusnpSynapseOffsets(const CuSnpBinaryHeader *header){
+  return (const uint64_t*)((const char*)header + header->synapse_offsets_offset);
+}
+
+inline const int32_t* cusnpSynapseTargets(const CuSnpBinaryHeader *header){
+  return (const int32_t*)((const char*)header + header->synapse_targets_offset);
+}
+
+inline const CuSnpBinaryRule* cusnpRules(const CuSnpBinaryHeader *header){
+  return (const CuSnpBinaryRule*)((const char*)header + header->rules_offset);
+}
+
+inline const char* cusnpRegex(const CuSnpBinaryHeader *header, int32_t regex){
+  const uint64_t *offsets = (const uint64_t*)((const char*)header + header->regex_offsets_offset);
+  return (const char*)header + header->regex_data_offset + offsets[regex];
+}
+
+//Progressions of a regex, count set to how many
+inline const CuSnpBinaryProgression* cusnpProgressions(const CuSnpBinaryHeader *header, int32_t regex,
+                                                       uint64_t& count){
+  const uint64_t *offsets = (const uint64_t*)((const char*)header + header->progression_offsets_offset);
+  count = offsets[regex+1] - offsets[regex];
+  return (const CuSnpBinaryProgression*)((const char*)header + header->progressions_offset) + offsets[regex];
+}
+
+//Whether a spike count is in one of a regex's progressions
+inline bool cusnpProgressionsMatch(const CuSnpBinaryProgression *progressions, uint64_t count, int64_t spikes){
+  for(uint64_t i=0;i<count;i++){
+    int64_t offset = progressions[i].offset, period = progressions[i].period;
+    if(period == 0 ? spikes == offset : spikes >= offset && (spikes-offset) % period == 0){
+      return true;
+    }
+  }
+  return false;
+}
+
+//Maps a binary CuSNP file read-only
+//returns NULL if the file cannot be mapped or is not a binary CuSNP file
+inline const CuSnpBinaryHeader* mapCuSnpBinary(const char *filename){
+  int fd = open(filename, O_RDONLY);
+  if(fd < 0){
+    return NULL;
+  }
+  struct stat info;
+  if(fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(CuSnpBinaryHeader)){
+    close(fd);
+    return NULL;
+  }
+  void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED){
+    return NULL;
+  }
+  const CuSnpBinaryHeader *header = (const CuSnpBinaryHeader*)data;
+  if(memcmp(header->magic, CUSNP_BINARY_MAGIC, sizeof(CUSNP_BINARY_MAGIC)) != 0 ||
+     header->version != CUSNP_BINARY_VERSION || header->file_size != (uint64_t)info.st_size){
+    munmap(data, info.st_size);
+    return NULL;
+  }
+  return header;
+}
+
+inline void unmapCuSnpBinary(const CuSnpBinaryHeader *header){
+  munmap((void*)header, header->file_size);
+}
+
+#endif
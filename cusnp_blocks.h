@@ -0,0 +1,331 @@
+#ifndef CUSNP_BLOCKS_H
+#define CUSNP_BLOCKS_H
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+//Block CuSNP file. A text format that keeps ranged synapse and rule
+//statements as loop nests over affine index expressions instead of one line
+//per synapse or rule, so an n x n block of synapses costs a single record.
+//Neurons are numbered as in the CuSNP text format.
+//
+//  CUSNP-BLOCKS 1
+//  neuron_count
+//  simulation_steps
+//  spikes[neuron_count]
+//  synapse_record_count
+//    s FROM TO                           one synapse, TO is -1 for an undeclared neuron
+//    S NEST PAIRS                        every (from, to) pair of PAIRS at every point of NEST
+//  rule_record_count
+//    r K ID[K] REGEX C P D               one rule of the K neurons sharing a label
+//    R NEST NEURON KIND [REGEX] C P D    KIND 0: REGEX follows, 1: the regex is a<C>
+//
+//NEST is the depth d, then LOWER and UPPER of every level k < d, affine over
+//the k enclosing variables with UPPER exclusive, then the number of
+//exceptions and each one affine over all d variables: points where an
+//exception is 0 are skipped. Variables are numbered from the outermost loop.
+//An affine expression is written as its constant followed by one coefficient
+//per variable. PAIRS is a count followed by that many from, to expressions.
+//Records expand in file order, which is the declaration order the text
+//format keeps among the synapses of a neuron.
+
+const char CUSNP_BLOCKS_MAGIC[] = "CUSNP-BLOCKS";
+const int CUSNP_BLOCKS_VERSION = 1;
+
+//constant + coefs[k]*vars[k]
+struct CuSnpAffine{
+  int64_t constant = 0;
+  std::vector<int64_t> coefs;
+};
+
+struct CuSnpNest{
+  std::vector<CuSnpAffine> lower;
+  std::vector<CuSnpAffine> upper;
+  std::vector<CuSnpAffine> exceptions;
+};
+
+//An s record is a nest of depth 0 with constant endpoints
+struct CuSnpSynapseRecord{
+  CuSnpNest nest;
+  std::vector<CuSnpAffine> endpoints;     //from, to of every pair
+};
+
+struct CuSnpRuleRecord{
+  bool family = false;
+  CuSnpNest nest;
+  std::vector<int64_t> neurons;           //r record
+  CuSnpAffine neuron;                     //R record
+  bool default_regex = false;
+  std::string regex;
+  CuSnpAffine c;
+  CuSnpAffine p;
+  CuSnpAffine d;
+};
+
+struct CuSnpBlocks{
+  int64_t simulation_steps = 0;
+  std::vector<int64_t> spikes;
+  std::vector<CuSnpSynapseRecord> synapses;
+  std::vector<CuSnpRuleRecord> rules;
+};
+
+inline int64_t cusnpEval(const CuSnpAffine& affine, const int64_t *vars){
+  int64_t value = affine.constant;
+  for(size_t k=0;k<affine.coefs.size();k++){
+    value += affine.coefs[k]*vars[k];
+  }
+  return value;
+}
+
+inline CuSnpAffine cusnpConstant(int64_t constant, int vars){
+  CuSnpAffine affine;
+  affine.constant = constant;
+  affine.coefs.assign(vars, 0);
+  return affine;
+}
+
+//Calls visit(vars) for every point of the nest, innermost variable fastest
+template<class Visit>
+inline void cusnpForEachPoint(const CuSnpNest& nest, Visit visit){
+  int depth = nest.lower.size();
+  std::vector<int64_t> vars(depth+1, 0);
+  std::vector<int64_t> limits(depth+1, 0);
+  int level = 0;
+  if(depth > 0){
+    vars[0] = cusnpEval(nest.lower[0], &vars[0]) - 1;
+    limits[0] = cusnpEval(nest.upper[0], &vars[0]);
+  } else {
+    limits[0] = 1;
+    vars[0] = -1;
+  }
+  while(level >= 0){
+    if(++vars[level] >= limits[level]){
+      level--;
+      continue;
+    }
+    if(level+1 < depth){
+      level++;
+      vars[level] = cusnpEval(nest.lower[level], &vars[0]) - 1;
+      limits[level] = cusnpEval(nest.upper[level], &vars[0]);
+      continue;
+    }
+    bool excluded = false;
+    for(size_t i=0;i<nest.exceptions.size();i++){
+      if(cusnpEval(nest.exceptions[i], &vars[0]) == 0) excluded = true;
+    }
+    if(!excluded){
+      visit((const int64_t*)&vars[0]);
+    }
+  }
+}
+
+inline void writeCuSnpAffine(std::ostream& out, const CuSnpAffine& affine){
+  out << affine.constant;
+  for(size_t k=0;k<affine.coefs.size();k++){
+    out << " " << affine.coefs[k];
+  }
+}
+
+inline void writeCuSnpNest(std::ostream& out, const CuSnpNest& nest){
+  out << nest.lower.size();
+  for(size_t k=0;k<nest.lower.size();k++){
+    out << " ";
+    writeCuSnpAffine(out, nest.lower[k]);
+    out << " ";
+    writeCuSnpAffine(out, nest.upper[k]);
+  }
+  out << " " << nest.exceptions.size();
+  for(size_t i=0;i<nest.exceptions.size();i++){
+    out << " ";
+    writeCuSnpAffine(out, nest.exceptions[i]);
+  }
+}
+
+inline bool readCuSnpAffine(std::istream& in, int vars, CuSnpAffine& affine){
+  affine.coefs.resize(vars);
+  in >> affine.constant;
+  for(int k=0;k<vars;k++){
+    in >> affine.coefs[k];
+  }
+  return (bool)in;
+}
+
+inline bool readCuSnpNest(std::istream& in, CuSnpNest& nest){
+  int depth = -1;
+  size_t exceptions = 0;
+  if(!(in >> depth) || depth < 0){
+    return false;
+  }
+  nest.lower.resize(depth);
+  nest.upper.resize(depth);
+  for(int k=0;k<depth;k++){
+    if(!readCuSnpAffine(in, k, nest.lower[k]) || !readCuSnpAffine(in, k, nest.upper[k])){
+      return false;
+    }
+  }
+  if(!(in >> exceptions)){
+    return false;
+  }
+  nest.exceptions.resize(exceptions);
+  for(size_t i=0;i<exceptions;i++){
+    if(!readCuSnpAffine(in, depth, nest.exceptions[i])){
+      return false;
+    }
+  }
+  return true;
+}
+
+//returns false if the stream is not a block CuSNP file or is truncated
+inline bool readCuSnpBlocks(std::istream& in, CuSnpBlocks& blocks){
+  std::string magic;
+  int version = 0;
+  size_t neuron_count = 0, records = 0;
+  if(!(in >> magic >> version >> neuron_count >> blocks.simulation_steps) ||
+     magic != CUSNP_BLOCKS_MAGIC || version != CUSNP_BLOCKS_VERSION){
+    return false;
+  }
+  blocks.spikes.resize(neuron_count);
+  for(size_t i=0;i<neuron_count;i++){
+    in >> blocks.spikes[i];
+  }
+  if(!(in >> records)){
+    return false;
+  }
+  blocks.synapses.resize(records);
+  for(size_t i=0;i<records;i++){
+    CuSnpSynapseRecord& record = blocks.synapses[i];
+    std::string kind;
+    size_t pairs = 1;
+    in >> kind;
+    if(kind == "S" && (!readCuSnpNest(in, record.nest) || !(in >> pairs))){
+      return false;
+    } else if(kind != "S" && kind != "s"){
+      return false;
+    }
+    int depth = record.nest.lower.size();
+    record.endpoints.resize(2*pairs);
+    for(size_t j=0;j<2*pairs;j++){
+      if(!readCuSnpAffine(in, depth, record.endpoints[j])){
+        return false;
+      }
+    }
+  }
+  if(!(in >> records)){
+    return false;
+  }
+  blocks.rules.resize(records);
+  for(size_t i=0;i<records;i++){
+    CuSnpRuleRecord& record = blocks.rules[i];
+    std::string kind;
+    in >> kind;
+    int depth = 0;
+    if(kind == "R"){
+      int regex_kind = 0;
+      record.family = true;
+      if(!readCuSnpNest(in, record.nest)){
+        return false;
+      }
+      depth = record.nest.lower.size();
+      if(!readCuSnpAffine(in, depth, record.neuron) || !(in >> regex_kind)){
+        return false;
+      }
+      record.default_regex = regex_kind == 1;
+      if(!record.default_regex){
+        in >> record.regex;
+      }
+    } else if(kind == "r"){
+      size_t count = 0;
+      in >> count;
+      record.neurons.resize(count);
+      for(size_t j=0;j<count;j++){
+        in >> record.neurons[j];
+      }
+      in >> record.regex;
+    } else {
+      return false;
+    }
+    if(!readCuSnpAffine(in, depth, record.c) || !readCuSnpAffine(in, depth, record.p) ||
+       !readCuSnpAffine(in, depth, record.d)){
+      return false;
+    }
+  }
+  return true;
+}
+
+//Writes the CuSNP text format the blocks describe
+inline void expandCuSnpBlocks(const CuSnpBlocks& blocks, std::ostream& out){
+  int64_t neuron_count = blocks.spikes.size();
+  std::vector<std::pair<int64_t, int64_t> > synapses;
+  for(size_t i=0;i<blocks.synapses.size();i++){
+    const CuSnpSynapseRecord& record = blocks.synapses[i];
+    cusnpForEachPoint(record.nest, [&](const int64_t *vars){
+      for(size_t j=0;j+1<record.endpoints.size();j+=2){
+        int64_t from = cusnpEval(record.endpoints[j], vars);
+        if(from >= 0 && from < neuron_count){
+          synapses.push_back(std::make_pair(from, cusnpEval(record.endpoints[j+1], vars)));
+        }
+      }
+    });
+  }
+  std::vector<int64_t> offsets(neuron_count+1, 0);
+  for(size_t i=0;i<synapses.size();i++){
+    offsets[synapses[i].first+1]++;
+  }
+  for(int64_t i=0;i<neuron_count;i++){
+    offsets[i+1] += offsets[i];
+  }
+  std::vector<int64_t> fill(offsets.begin(), offsets.end()-1);
+  std::vector<int64_t> targets(synapses.size());
+  for(size_t i=0;i<synapses.size();i++){
+    targets[fill[synapses[i].first]++] = synapses[i].second;
+  }
+
+  std::vector<std::string> rules;
+  for(size_t i=0;i<blocks.rules.size();i++){
+    const CuSnpRuleRecord& record = blocks.rules[i];
+    if(!record.family){
+      std::string line;
+      for(size_t j=0;j<record.neurons.size();j++){
+        line += std::to_string(record.neurons[j]) + " ";
+      }
+      line += record.regex + " " + std::to_string(record.c.constant) + " " +
+              std::to_string(record.p.constant) + " " + std::to_string(record.d.constant);
+      rules.push_back(line);
+      continue;
+    }
+    cusnpForEachPoint(record.nest, [&](const int64_t *vars){
+      int64_t c = cusnpEval(record.c, vars);
+      std::string regex = record.default_regex ? "a" + std::to_string(c) : record.regex;
+      rules.push_back(std::to_string(cusnpEval(record.neuron, vars)) + " " + regex + " " +
+                      std::to_string(c) + " " + std::to_string(cusnpEval(record.p, vars)) + " " +
+                      std::to_string(cusnpEval(record.d, vars)));
+    });
+  }
+
+  out << neuron_count << '\n';
+  out << rules.size() << '\n';
+  out << blocks.simulation_steps << '\n';
+  for(int64_t i=0;i<neuron_count;i++){
+    out << blocks.spikes[i] << " ";
+  }
+  out << '\n';
+  for(int64_t i=0;i<neuron_count;i++){
+    out << offsets[i+1] - offsets[i] << " ";
+    for(int64_t j=offsets[i];j<offsets[i+1];j++){
+      if(targets[j] >= 0){
+        out << targets[j] << " ";
+      }
+    }
+    out << '\n';
+  }
+  for(size_t i=0;i<rules.size();i++){
+    out << rules[i] << '\n';
+  }
+  out.flush();
+}
+
+#endif
@@ -0,0 +1,360 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+//Benchmark suite for snp_pli_parser: generates parameterized .pli workloads,
+//runs the parser on each of them once per mode and reports wall time, the
+//parser's own parse, compile, expand and run phase times (from --stats),
+//peak RSS and output size. Results are also written as tab separated values
+//so runs can be compared over time. The simulate modes run the same number
+//of steps with each transition kernel, so they compare the scalar and AVX2
+//kernels on the same system. The parser's stderr is only read for --stats
+//and, when a run fails, its last line is printed.
+//
+//  g++ -O2 -o snp_bench snp_bench.cpp
+//  ./snp_bench [--parser ./snp_pli_parser] [--out bench_results.tsv] [--quick] [--keep]
+
+const char *HEADER = "@model<spiking_psystems>";
+const int SORTING_SIZES[] = {16, 64, 256, 1024, 4096};
+const int SORTING_SIZE_COUNT = 5;
+const int FLAT_SIZES[] = {10000, 100000, 1000000};
+const int FLAT_SIZE_COUNT = 3;
+const int NESTED_SIZES[] = {16, 32, 64, 128};
+const int NESTED_SIZE_COUNT = 4;
+const int QUICK_SORTING_MAX = 256;
+const int QUICK_FLAT_MAX = 100000;
+const int QUICK_NESTED_MAX = 32;
+const int FLAT_NEURONS = 4096;
+const char *MODES[] = {"text", "stream", "binary", "simulate-scalar", "simulate-avx2"};
+const int MODE_COUNT = 5;
+const char *STATS_PHASE = "phase ";
+const char *SIMULATE_STEPS = "200";
+
+class Workload{
+  public:
+    string name;
+    int size;
+    string file;
+};
+
+class BenchResult{
+  public:
+    string workload;
+    int size;
+    string mode;
+    double wall_seconds;
+    double parse_seconds = -1;    //phases reported by --stats, -1 if missing
+    double compile_seconds = -1;
+    double expand_seconds = -1;
+    double run_seconds = -1;      //writing the output or simulating
+    long peak_rss_kb;
+    long output_bytes;
+    int status;                   //exit status of the parser, -1 if it did not exit normally
+};
+
+void writeSortingNetwork(const string& file, int n);
+void writeFlatArcs(const string& file, int arcs);
+void writeNestedRanges(const string& file, int n);
+vector<Workload> generateWorkloads(const string& dir, bool quick);
+BenchResult runMode(const string& parser, const Workload& workload, const string& mode, const string& dir);
+void readStats(const string& file, BenchResult& result);
+string lastLine(const string& file);
+long fileSize(const string& file);
+void printResult(const BenchResult& result);
+void writeResults(const string& file, const vector<BenchResult>& results);
+
+int main(int argc, char **argv){
+  string parser = "./snp_pli_parser";
+  string results_file = "bench_results.tsv";
+  bool quick = false;
+  bool keep = false;
+  for(int i=1;i<argc;i++){
+    string in(argv[i]);
+    if(in == "--parser" && i+1 < argc){
+      parser = argv[++i];
+    } else if(in == "--out" && i+1 < argc){
+      results_file = argv[++i];
+    } else if(in == "--quick"){
+      quick = true;
+    } else if(in == "--keep"){
+      keep = true;
+    } else {
+      cerr << "usage: " << argv[0] << " [--parser PATH] [--out FILE] [--quick] [--keep]\n";
+      return 1;
+    }
+  }
+
+  char dir_template[] = "/tmp/snp_bench.XXXXXX";
+  if(mkdtemp(dir_template) == NULL){
+    cerr << "cannot create a working directory\n";
+    return 1;
+  }
+  string dir(dir_template);
+
+  vector<Workload> workloads = generateWorkloads(dir, quick);
+  vector<BenchResult> results;
+  cout << "workload\tsize\tmode\twall_s\tparse_s\tcompile_s\texpand_s\trun_s\tpeak_rss_kb\toutput_bytes\tstatus\n";
+  for(int i=0;i<workloads.size();i++){
+    for(int j=0;j<MODE_COUNT;j++){
+      BenchResult result = runMode(parser, workloads[i], MODES[j], dir);
+      printResult(result);
+      results.push_back(result);
+    }
+    if(!keep){
+      remove(workloads[i].file.c_str());
+    }
+  }
+  writeResults(results_file, results);
+  if(!keep){
+    rmdir(dir.c_str());
+  } else {
+    cout << "workloads kept in " << dir << "\n";
+  }
+  return 0;
+}
+
+//Sorting network of sorting_network.pli: n inputs, n^2 + n(n+1)/2 synapses
+//and n^2 rules
+void writeSortingNetwork(const string& file, int n){
+  ofstream out(file.c_str());
+  out << HEADER << "\n\n";
+  out << "def main(){\n";
+  out << "  call init_snp(" << n << ");\n";
+  out << "  call init_config(" << n << ");\n";
+  out << "  call init_spiking_rules(" << n << ");\n";
+  out << "}\n\n";
+  out << "def init_snp(n){\n";
+  out << "  @mu = in{i} : 1<=i<=n;\n";
+  out << "  @mu += m{i} : 1<=i<=n;\n";
+  out << "  @mu += o{i} : 1<=i<=n;\n\n";
+  out << "  @marcs = (in{i}, m{j}) : 1<=i<=n, 1<=j<=n;\n";
+  out << "  @marcs += (m{j}, o{i}) : i<=j<=n, 1<=i<=n;\n";
+  out << "}\n\n";
+  out << "def init_config(n){\n";
+  out << "  @ms(in{i}) = a*(n-i+1) : 1<=i<=n;\n";
+  out << "}\n\n";
+  out << "def init_spiking_rules(n){\n";
+  out << "  [a --> a]'in{i} \"a*\": 1<=i<=n;\n";
+  out << "  [a*(n-i+1) --> a]'m{i} : 1<=i<=n;\n";
+  out << "  [a*(j) --> #]'m{i} : 1<=i<=n, 1<=j<=n, j<>n-i+1;\n";
+  out << "}\n";
+}
+
+//One literal statement per line like sort_8_input.pli: the neuron list,
+//then the given number of @marcs += ( a , b ) lines, spikes and rules
+void writeFlatArcs(const string& file, int arcs){
+  ofstream out(file.c_str());
+  out << HEADER << "\n";
+  out << "def main(){\n\n";
+  out << "    @masynch = 0;\n";
+  out << "    @mseq = 0;\n\n";
+  out << " @mu = 0";
+  for(int i=1;i<FLAT_NEURONS;i++){
+    out << " , " << i;
+  }
+  out << " ;\n";
+  unsigned int state = 12345;
+  for(int i=0;i<arcs;i++){
+    state = state*1103515245 + 12345;
+    int from = i % FLAT_NEURONS;
+    int to = (state >> 8) % FLAT_NEURONS;
+    out << "@marcs += ( " << from << " , " << to << " );\n";
+  }
+  out << "\n";
+  for(int i=0;i<FLAT_NEURONS;i+=8){
+    out << "@ms(" << i << ") = a* " << (i % 97) + 1 << " ;\n";
+  }
+  for(int i=0;i<FLAT_NEURONS;i++){
+    out << "[a --> a]'" << i << " \"a*\";\n";
+    out << "[a*2 --> #]'" << i << " \"aa\";\n";
+  }
+  out << "}\n";
+}
+
+//Three levels of ranges with <> exceptions: n^2 - n synapses and about n^3
+//forgetting rules
+void writeNestedRanges(const string& file, int n){
+  ofstream out(file.c_str());
+  out << HEADER << "\n\n";
+  out << "def main(){\n";
+  out << "  call grid(" << n << ");\n";
+  out << "}\n\n";
+  out << "def grid(n){\n";
+  out << "  @mu = x{i} : 1<=i<=n;\n";
+  out << "  @ms(x{i}) = a*(i) : 1<=i<=n;\n";
+  out << "  @marcs = (x{i}, x{j}) : 1<=i<=n, 1<=j<=n, i<>j;\n";
+  out << "  [a*(j) --> a]'x{i} :: k : 1<=i<=n, 1<=j<=n, 0<=k<n, j<>i, k<>j;\n";
+  out << "}\n";
+}
+
+vector<Workload> generateWorkloads(const string& dir, bool quick){
+  vector<Workload> workloads;
+  for(int i=0;i<SORTING_SIZE_COUNT;i++){
+    if(quick && SORTING_SIZES[i] > QUICK_SORTING_MAX) continue;
+    Workload workload;
+    workload.name = "sorting_network";
+    workload.size = SORTING_SIZES[i];
+    workload.file = dir + "/sorting_network_" + to_string(workload.size) + ".pli";
+    writeSortingNetwork(workload.file, workload.size);
+    workloads.push_back(workload);
+  }
+  for(int i=0;i<FLAT_SIZE_COUNT;i++){
+    if(quick && FLAT_SIZES[i] > QUICK_FLAT_MAX) continue;
+    Workload workload;
+    workload.name = "flat_arcs";
+    workload.size = FLAT_SIZES[i];
+    workload.file = dir + "/flat_arcs_" + to_string(workload.size) + ".pli";
+    writeFlatArcs(workload.file, workload.size);
+    workloads.push_back(workload);
+  }
+  for(int i=0;i<NESTED_SIZE_COUNT;i++){
+    if(quick && NESTED_SIZES[i] > QUICK_NESTED_MAX) continue;
+    Workload workload;
+    workload.name = "nested_ranges";
+    workload.size = NESTED_SIZES[i];
+    workload.file = dir + "/nested_ranges_" + to_string(workload.size) + ".pli";
+    writeNestedRanges(workload.file, workload.size);
+    workloads.push_back(workload);
+  }
+  return workloads;
+}
+
+//Runs the parser with --stats on a workload in its own process: text writes
+//CuSNP to stdout, stream does the same with --stream and binary writes
+//--binary FILE. simulate-KERNEL simulates SIMULATE_STEPS steps with
+//--kernel KERNEL. Peak RSS is the child's, as reported by wait4
+BenchResult runMode(const string& parser, const Workload& workload, const string& mode, const string& dir){
+  BenchResult result;
+  result.workload = workload.name;
+  result.size = workload.size;
+  result.mode = mode;
+  result.status = -1;
+
+  string stdout_file = dir + "/output.txt";
+  string stderr_file = dir + "/stderr.txt";
+  string binary_file = dir + "/output.bin";
+  vector<string> args;
+  args.push_back(parser);
+  args.push_back(workload.file);
+  args.push_back("--stats");
+  if(mode == "stream"){
+    args.push_back("--stream");
+  } else if(mode == "binary"){
+    args.push_back("--binary");
+    args.push_back(binary_file);
+  } else if(mode.compare(0, 9, "simulate-") == 0){
+    args.push_back("--simulate");
+    args.push_back("-s");
+    args.push_back(SIMULATE_STEPS);
+    args.push_back("--kernel");
+    args.push_back(mode.substr(9));
+  }
+  vector<char*> argv;
+  for(int i=0;i<args.size();i++){
+    argv.push_back((char*)args[i].c_str());
+  }
+  argv.push_back(NULL);
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  pid_t pid = fork();
+  if(pid == 0){
+    int out = open(stdout_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int err = open(stderr_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    dup2(out, STDOUT_FILENO);
+    dup2(err, STDERR_FILENO);
+    execv(argv[0], &argv[0]);
+    perror(argv[0]);
+    _exit(127);
+  }
+  int status = 0;
+  struct rusage usage;
+  memset(&usage, 0, sizeof(usage));
+  if(pid > 0 && wait4(pid, &status, 0, &usage) == pid && WIFEXITED(status)){
+    result.status = WEXITSTATUS(status);
+  }
+  result.wall_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  result.peak_rss_kb = usage.ru_maxrss;
+  result.output_bytes = mode == "binary" ? fileSize(binary_file) : fileSize(stdout_file);
+  readStats(stderr_file, result);
+  if(result.status != 0){
+    cerr << workload.name << " " << workload.size << " " << mode << " failed: " << lastLine(stderr_file) << "\n";
+  }
+  remove(stdout_file.c_str());
+  remove(stderr_file.c_str());
+  remove(binary_file.c_str());
+  return result;
+}
+
+//Reads the "phase NAME: SECONDS s" lines --stats prints
+void readStats(const string& file, BenchResult& result){
+  ifstream in(file.c_str());
+  string line;
+  while(getline(in, line)){
+    if(line.compare(0, strlen(STATS_PHASE), STATS_PHASE) != 0) continue;
+    size_t colon = line.find(':');
+    if(colon == string::npos) continue;
+    string name = line.substr(strlen(STATS_PHASE), colon - strlen(STATS_PHASE));
+    double seconds = atof(line.c_str() + colon + 1);
+    if(name == "parse"){
+      result.parse_seconds = seconds;
+    } else if(name == "compile"){
+      result.compile_seconds = seconds;
+    } else if(name == "expand"){
+      result.expand_seconds = seconds;
+    } else {
+      result.run_seconds = seconds;
+    }
+  }
+}
+
+//returns "" if the file is empty or missing
+string lastLine(const string& file){
+  ifstream in(file.c_str());
+  string line, last;
+  while(getline(in, line)){
+    if(!line.empty()) last = line;
+  }
+  return last;
+}
+
+//returns -1 if the file does not exist
+long fileSize(const string& file){
+  struct stat info;
+  if(stat(file.c_str(), &info) != 0){
+    return -1;
+  }
+  return info.st_size;
+}
+
+void printResult(const BenchResult& result){
+  cout << result.workload << "\t" << result.size << "\t" << result.mode << "\t"
+       << result.wall_seconds << "\t" << result.parse_seconds << "\t" << result.compile_seconds << "\t"
+       << result.expand_seconds << "\t" << result.run_seconds << "\t" << result.peak_rss_kb << "\t"
+       << result.output_bytes << "\t" << result.status << endl;
+}
+
+void writeResults(const string& file, const vector<BenchResult>& results){
+  ofstream out(file.c_str());
+  out << "workload\tsize\tmode\twall_seconds\tparse_seconds\tcompile_seconds\texpand_seconds\t"
+      << "run_seconds\tpeak_rss_kb\toutput_bytes\tstatus\n";
+  for(int i=0;i<results.size();i++){
+    out << results[i].workload << "\t" << results[i].size << "\t" << results[i].mode << "\t"
+        << results[i].wall_seconds << "\t" << results[i].parse_seconds << "\t"
+        << results[i].compile_seconds << "\t" << results[i].expand_seconds << "\t"
+        << results[i].run_seconds << "\t" << results[i].peak_rss_kb << "\t"
+        << results[i].output_bytes << "\t" << results[i].status << "\n";
+  }
+}
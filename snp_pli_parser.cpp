@@ -6,6 +6,31 @@
 #include <algorithm>
 #include <iterator>
 #include <stack>
+#include <cmath>
+#include <unordered_map>
+#include <queue>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <regex>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <unordered_set>
+#include <deque>
+#include <exception>
+#include <string_view>
+#include <chrono>
+#include <memory>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SNP_AVX2_KERNEL
+#endif
+#include "cusnp_binary.h"
+#include "cusnp_blocks.h"
 
 using namespace std;
 
@@ -19,59 +44,187 @@ const string SPECIAL_KEYWORDS[] = {"def", "call"};
 const short SPECIAL_DEF_INDEX = 0;
 const short SPECIAL_CALL_INDEX = 1;
 const int SPECIAL_KEYWORD_COUNT = 2;
+const string SYMBOLS[] = {"-->", "+=", "<=", "=<", "<>", "::"};
+const int SYMBOL_COUNT = 6;
+const int TOK_IDENT = 0, TOK_NUMBER = 1, TOK_KEYWORD = 2,
+          TOK_STRING = 3, TOK_SYMBOL = 4, TOK_END = 5,
+          TOK_EOF = 6;
+const int STMT_NONE = 0, STMT_CALL = 1, STMT_MU = 2,
+          STMT_MS = 3, STMT_ARCS = 4, STMT_RULE = 5;
+const int SPILL_RUN_RECORDS = 1 << 20;
+const long PARALLEL_MIN_ITEMS = 4096;
+const int CONFIG_SET_SHARDS = 64;
+const int RANGE_SLICES_PER_THREAD = 4;
+const size_t STRING_POOL_BLOCK = 1 << 16;
+const int CONSUME_ALL = -1;          //c of a set rule
+const int PROGRESSION_LIMIT = 16;    //progressions a compiled regex may union
+const long SPIKE_TABLE_MAX = 1 << 16; //entries in one neuron's spike count table
+const int KERNEL_AUTO = 0, KERNEL_SCALAR = 1, KERNEL_AVX2 = 2;
+const int SPIKE_TABLE_RULES = 64;    //rules a neuron may have to get a table
+const int BATCH_LANES = 4;           //configurations a batch steps at once, one per AVX2 lane
+const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+const uint64_t FNV_PRIME = 1099511628211ULL;
+const char FRAGMENT_MAGIC[8] = {'S', 'N', 'P', 'F', 'R', 'A', 'G', '1'};
+const char *CACHE_VERSION = "snp-cache-4";
+const int FRAG_CLEAR = 0, FRAG_NEURON = 1, FRAG_RULE = 2,
+          FRAG_SYNAPSE = 3, FRAG_SET_SPIKE = 4, FRAG_ADD_SPIKE = 5;
+const int FRAG_OP_INTS[] = {1, 2, 6, 3, 3, 3};
+const int FRAG_OP_COUNT = 6;
+const long FRAGMENT_MIN_INTS = 4096;
+const long FRAGMENT_BUFFER = 1 << 16;
+const int EXP_CONST = 0, EXP_VAR = 1, EXP_ADD = 2,
+          EXP_SUB = 3, EXP_MUL = 4, EXP_DIV = 5,
+          EXP_POW = 6;
 
 class MethodHolder;
+class SourceFile;
+class StringPool;
+class Token;
+class Parser;
+class Statement;
 class SNP;
 class Parameter;
-class Neuron;
 class Rule;
+class SpikeSet;
+class Progression;
+class RuleGroups;
 class Synapse;
 class Range;
-class TreeNode;
+class RangeIterator;
+class SpillStore;
+class SynapseFamily;
+class RuleFamily;
+class FamilyStore;
+class CuSnpTables;
+class Adjacency;
+class ThreadPool;
+class SimRegex;
+class Simulator;
+class ConfigHash;
+class ConfigShard;
+class ConfigSet;
+class WorkDeque;
+class ExploreLevel;
+class MathExp;
+class Environment;
+class BoundExp;
+class LabelTemplate;
+class Stats;
+class CountingBuffer;
+class Fragment;
+class CompileCache;
 
-class MethodHolder{
+class Parameter{
   public:
     string label;
-    vector<Parameter> parameters;
-    vector<string> contents;
+    int value;
 };
 
-class Parameter{
+//A .pli file mapped read-only while it is parsed
+class SourceFile{
   public:
-    string label;
-    int value;
+    const char *data = NULL;
+    size_t size = 0;
 };
 
-class SNP{
+//Interned strings: each distinct string is copied once into blocks that
+//never move, so the views in strings and ids stay valid as the pool grows
+class StringPool{
   public:
-    vector<Neuron> neurons;
-    vector<Rule> rules;
-    vector<Synapse> synapses;
-    int simulationsteps = 100;
+    vector<unique_ptr<char[]> > blocks;
+    size_t block_used = 0;
+    vector<string_view> strings;              //id -> string
+    unordered_map<string_view, int> ids;      //string -> id
 };
 
-class Neuron{
+//The system as parallel arrays, so a scan only touches the fields it needs:
+//neuron i is neuron_labels[i], spikes[i] and next_same_label[i], rules and
+//synapses likewise. Rules and synapses refer to label ids, resolved to
+//neurons through label_neurons when the system is emitted
+class SNP{
   public:
-    string label;
-    int spikes;
-    Parameter param;
-    vector<Synapse> syns;
-    int id;
+    vector<int> neuron_labels;
+    vector<int64_t> spikes;
+    vector<int> next_same_label;              //next neuron declared with the same label, -1 if none
+    vector<int> rule_labels;
+    vector<int> rule_regexes;
+    vector<int> rule_c;
+    vector<int> rule_p;
+    vector<int> rule_d;
+    vector<int> synapse_from;
+    vector<int> synapse_to;
+    StringPool labels;                        //neuron labels
+    StringPool regexes;                       //rule regexes
+    vector<int> label_neurons;                //label id -> first neuron with the label, -1 if none
+    bool rule_sets = false;                   //ranged rule families kept as set rules
+    vector<long> progression_offsets;         //regex id -> its progressions, none if not compiled
+    vector<Progression> progressions;         //rule regexes as unions of progressions
+    int simulationsteps = 100;
 };
 
+//A rule or synapse on its way into the SNP, also the record spilled by --stream
 class Rule{
   public:
-    string neuron_label;
-    string regex;
+    int neuron_label;            //label id, resolved to neurons when the system is emitted
+    int regex;                   //regex id
     int c;
     int p;
     int d;
 };
 
+//Spike counts a set rule applies to, consuming all of them: it stands for
+//the a<k> rules of one neuron from k = LOW to HIGH less the excluded ones.
+//Its regex is a[LOW,HIGH] or a[LOW,HIGH]!E,E...
+class SpikeSet{
+  public:
+    long low;
+    long high;
+    vector<long> excluded;        //ascending
+};
+
+//Spike counts offset + period*n for n >= 0, offset alone when period is 0
+class Progression{
+  public:
+    long offset;
+    long period;
+};
+
+//Rules of a ranged rule statement grouped by neuron label (--rule-sets)
+class RuleGroups{
+  public:
+    vector<int> order;                        //label ids in order of their first rule
+    unordered_map<int, vector<Rule> > rules;
+};
+
 class Synapse{
   public:
-    string from;
-    string to;
+    int from;     //label ids, resolved to neurons when the system is emitted
+    int to;
+};
+
+class MathExp{
+  public:
+    vector<int> code;             //postfix program: opcode [operand]
+    vector<string> variables;     //variable slot -> label
+    int depth = 0;                //evaluation stack needed
+};
+
+class Environment{
+  public:
+    vector<string> labels;        //method parameters, then range variables, only while compiling
+    vector<int> values;
+};
+
+class BoundExp{
+  public:
+    const MathExp *exp;
+    vector<int> slots;            //variable slot -> environment index
+};
+
+class LabelTemplate{
+  public:
+    vector<string> text;          //literal text around each substituted variable
+    vector<int> slots;            //environment index printed after text[i]
 };
 
 class Range{
@@ -81,55 +234,477 @@ class Range{
     bool inclusive_x1;
     string x2;
     bool inclusive_x2;
+    BoundExp x1_exp;
+    BoundExp x2_exp;
+};
+
+//Odometer over the index space of a range list, binding one
+//combination of values at a time into the environment. Each exception is
+//decided at the deepest level it refers to, either solved for the values
+//that level skips (affine in its variable) or tested once the level is bound
+class RangeIterator{
+  public:
+    vector<Range> levels;         //outermost range first
+    vector<Range> exceptions;
+    vector<int> slots;            //environment index of each level's variable
+    vector<int> limits;           //exclusive upper bound of each level
+    vector<vector<int> > solved;  //level -> exceptions solved for the level's variable
+    vector<vector<int> > checks;  //level -> exceptions tested once the level is bound
+    vector<vector<int> > excluded;//level -> values skipped, from solved, set when the level opens
+    bool started = false;
+};
+
+class Token{
+  public:
+    int kind;
+    string_view text;             //into the source, without the quotes of a string
+    int line;
+};
+
+class Parser{
+  public:
+    vector<Token> tokens;         //ends with TOK_EOF
+    size_t pos = 0;
+};
+
+//One statement of a method body, parsed once when the file is read
+class Statement{
+  public:
+    int kind = STMT_NONE;
+    int line = 0;
+    bool append = false;          //+= rather than =
+    string name;                  //call: method called
+    vector<string> args;          //call: argument expressions
+    vector<string> labels;        //@mu: neurons, @marcs: from and to of each pair, @ms and rules: the neuron
+    vector<string> label_vars;    //@mu with a range: the label{variable} of each neuron, labels hold the prefix
+    string spikes;                //@ms: spikes set, rules: spikes consumed
+    string produced;              //rules: spikes produced
+    string delay;                 //rules
+    string regex;                 //rules, empty for a<spikes consumed>
+    bool has_range = false;
+    vector<Range> ranges;         //in source order
+    vector<Range> exceptions;
+
+    //Bound by compileMethod against the def's parameters, then the range variables
+    int callee = -1;              //call: index into methods
+    vector<BoundExp> arg_exps;
+    vector<LabelTemplate> label_exps;
+    BoundExp spikes_exp;
+    BoundExp produced_exp;
+    BoundExp delay_exp;
+    RangeIterator range_iter;     //bound, not started
 };
 
-class TreeNode{
+class MethodHolder{
   public:
     string label;
-    int value;
-    vector<TreeNode> children;
-    TreeNode *parent;
+    vector<Parameter> parameters;
+    vector<Statement> body;
+    uint64_t source_hash = 0;     //tokens of the def
+    uint64_t hash = 0;            //source_hash of the def and of every def it can call
+};
+
+//Temporary files rules and synapses are written to while the model is
+//expanded when output is streamed (--stream)
+class SpillStore{
+  public:
+    FILE *rules = NULL;
+    FILE *synapses = NULL;
+    long rule_count = 0;
+    long rule_lines = 0;          //rule_count with set rules expanded
+    long synapse_count = 0;
+};
+
+//A ranged @marcs statement kept unexpanded for --blocks, with the frame it
+//was reached in. position is the number of plain synapses declared before it
+class SynapseFamily{
+  public:
+    long position;
+    RangeIterator ranges;
+    Environment env;
+    vector<LabelTemplate> entry;
+};
+
+//A ranged rule statement kept unexpanded for --blocks, position counts rules
+class RuleFamily{
+  public:
+    long position;
+    RangeIterator ranges;
+    Environment env;
+    LabelTemplate neuron;
+    string regex;
+    BoundExp c;
+    BoundExp p;
+    BoundExp d;
+};
+
+//Ranged synapses and rules recorded while the model is expanded for --blocks
+class FamilyStore{
+  public:
+    bool enabled = false;
+    vector<SynapseFamily> synapses;
+    vector<RuleFamily> rules;
+};
+
+//Id-resolved view of an SNP as laid out in the binary CuSNP format
+class CuSnpTables{
+  public:
+    int64_t simulationsteps;
+    vector<int64_t> spikes;
+    vector<uint64_t> synapse_offsets;
+    vector<int32_t> synapse_targets;
+    vector<CuSnpBinaryRule> rules;
+    vector<string> regexes;
+    unordered_map<string, int> regex_ids;
+};
+
+//Compressed sparse row form of the synapses: the targets of neuron i are
+//targets[offsets[i]] .. targets[offsets[i+1]-1], in declaration order
+class Adjacency{
+  public:
+    vector<long> offsets;
+    vector<int> targets;          //-1 where the target label was never declared
+};
+
+//Counters and wall time per phase reported on stderr with --stats, the
+//atomic counters are bumped from the workers of a parallel expansion
+class Stats{
+  public:
+    bool enabled = false;
+    vector<string> phase_names;
+    vector<double> phase_seconds;
+    atomic<long> mathexp_evals{0};
+    atomic<long> label_renders{0};
+    atomic<long> range_leaves{0};
+    long neurons = 0;
+    long rules = 0;
+    long synapses = 0;
+    long bytes_written = 0;
+};
+
+//What a call made by main adds to the system, recorded for --cache. Ops
+//name labels and regexes by index into the fragment's own string table
+class Fragment{
+  public:
+    vector<string> strings;
+    unordered_map<string, int> string_ids;
+    vector<int> ops;              //not yet written to file
+    long op_ints = 0;             //ints recorded so far
+    FILE *file = NULL;            //opened once the ops outgrow the buffer
+    string temp_path;
+};
+
+//On-disk cache of whole outputs and of the fragments of main's calls (--cache)
+class CompileCache{
+  public:
+    string dir;
+    string output;                //cached output of this run, empty if outputs are not cached
+    bool fragments = false;
+    bool recording = false;
+    Fragment fragment;
+    ofstream capture;             //text output on its way into the cache
+    streambuf *stdout_buffer = NULL;
+};
+
+//Passes everything written to cout through to its buffer, counting the bytes
+class CountingBuffer : public streambuf{
+  public:
+    streambuf *target = NULL;
+    long bytes = 0;
+  protected:
+    int overflow(int c){
+      if(c == EOF){
+        return target->pubsync() == 0 ? 0 : EOF;
+      }
+      bytes++;
+      return target->sputc(c);
+    }
+    streamsize xsputn(const char *s, streamsize n){
+      bytes += n;
+      return target->sputn(s, n);
+    }
+    int sync(){
+      return target->pubsync();
+    }
+};
+
+//Fixed set of worker threads that parallelFor hands index ranges to
+class ThreadPool{
+  public:
+    vector<thread> workers;
+    mutex lock;
+    condition_variable wake;
+    condition_variable finished;
+    const function<void(long, long)> *job = NULL;
+    long job_size = 0;
+    long chunk = 1;
+    atomic<long> next{0};
+    int remaining = 0;            //workers that have not finished the current job
+    long generation = 0;          //incremented for every job
+    bool stopping = false;
+};
+
+class SimRegex{
+  public:
+    const Progression *progressions;
+    int progression_count;        //0 if the regex is matched with std::regex
+    bool set = false;             //set rule, matching the counts of spike_set
+    SpikeSet spike_set;
+    unordered_map<string, regex>::const_iterator pattern;
+};
+
+//Matrix representation of a running system: configuration vector C_k, spiking
+//vector S_k (as the rule fired by each neuron) and what the transition matrix
+//needs, rules grouped by neuron and the neurons feeding each neuron
+class Simulator{
+  public:
+    vector<long> config;
+    vector<long> next_config;
+    vector<int> spiking;          //neuron -> rule fired this step, -1 if none
+    vector<int> rule_neurons;
+    vector<int> rule_c;
+    vector<int> rule_p;
+    vector<SimRegex> rule_regexes;
+    Adjacency neuron_rules;       //rule ids of every neuron, in declaration order
+    Adjacency incoming;           //first source of each run of consecutive source neurons feeding every neuron
+    vector<int> run_lengths;      //sources in each run of incoming
+    vector<long> emitted;         //spikes each neuron sends this step
+    bool avx2 = false;            //transition accumulated with the AVX2 kernel
+    vector<long> table_offsets;   //neuron -> its spike count table in rule_masks, empty if none
+    vector<long> table_bases;     //count from which a neuron's table repeats to its end
+    vector<uint64_t> rule_masks;  //spike count -> applicable rules, bit j for the neuron's j-th rule
+};
+
+//FNV-1a's xor and multiply step applied once per spike count of a
+//configuration, each whole count taken as one word rather than byte by byte
+class ConfigHash{
+  public:
+    size_t operator()(const vector<long>& config) const {
+      size_t hash = FNV_OFFSET;
+      for(int i=0;i<config.size();i++){
+        hash = (hash ^ (size_t)config[i]) * FNV_PRIME;
+      }
+      return hash;
+    }
+};
+
+//Set of explored configurations, sharded so workers rarely share a lock
+class ConfigShard{
+  public:
+    mutex lock;
+    unordered_set<vector<long>, ConfigHash> configs;
+};
+
+class ConfigSet{
+  public:
+    ConfigShard shards[CONFIG_SET_SHARDS];
+};
+
+//Configurations of the current level still to be expanded by one worker
+class WorkDeque{
+  public:
+    mutex lock;
+    deque<vector<long> > configs;
+};
+
+//What one worker found while expanding a level
+class ExploreLevel{
+  public:
+    vector<vector<long> > configs;
+    long halting = 0;
 };
 
-void parseFile(char *filename, int steps);
-void parseFile(char *filename);
-void runMethod(MethodHolder method, vector<Parameter> params);
-void parseRule(string line, MethodHolder method, vector<Parameter> params);
-void createRules(TreeNode &node, string neuron_, string regex_, string c_, string p_, string d_);
-void eval_mu(string line, MethodHolder method, vector<Parameter> params);
-void recursiveCreateNeurons(TreeNode& root, vector<Neuron>& neurons, vector<Neuron>& temp);
-void eval_ms(string line, MethodHolder method, vector<Parameter> params);
-void recursiveCreateSpikes(TreeNode node, string entry);
-void setSpike(string neuron_label, int spikes);
-void addSpike(string neuron_label, int spikes);
-void eval_arcs(string line, MethodHolder method, vector<Parameter> params);
-void recursiveCreateSynapses(TreeNode node, string entry);
-void addSynapse(string entry);
-int findMethod(string query);
-int evalMathExp(string mathexp);
-string subsMathExp(string line, vector<Parameter> params);
-string matchParameters(string line, vector<Parameter> params);
-string matchParameters(string line, vector<Parameter> param_needed, vector<Parameter> param_provided);
-void identifyRanges(string entry, TreeNode& root);
-void recursiveBranching(TreeNode& node, Range range, vector<Range> exceptions);
+bool parseFile(char *filename, int steps);
+bool parseFile(char *filename);
+void runMethod(const MethodHolder& method, const Environment& frame);
+void compileProgram();
+void compileMethod(MethodHolder& method);
+Environment rangeFrame(const Statement& stmt, const Environment& frame);
+void lexSource(string_view source, vector<Token>& tokens);
+bool isSymbol(const Token& token, string_view symbol);
+bool acceptSymbol(Parser& parser, string_view symbol);
+bool acceptSpike(Parser& parser);
+bool atStatementEnd(const Parser& parser);
+string tokenText(const Parser& parser, size_t begin, size_t end);
+string parseSpan(Parser& parser, const vector<string_view>& stops);
+void skipStatement(Parser& parser);
+bool parseRanges(Parser& parser, Statement& stmt);
+bool parseMu(Parser& parser, Statement& stmt);
+bool parseMs(Parser& parser, Statement& stmt);
+bool parseArcs(Parser& parser, Statement& stmt);
+bool parseRule(Parser& parser, Statement& stmt);
+bool parseCall(Parser& parser, Statement& stmt);
+bool parseStatement(Parser& parser, Statement& stmt);
+size_t countStatements(const Parser& parser);
+bool parseDef(Parser& parser, MethodHolder& method);
+vector<MethodHolder> parseProgram(string_view source);
+void eval_call(const Statement& stmt, const Environment& frame);
+void eval_rule(const Statement& stmt, const Environment& frame);
+void createRules(RangeIterator& ranges, Environment& env, const LabelTemplate& neuron_, const string& regex_,
+                 const BoundExp& c_, const BoundExp& p_, const BoundExp& d_);
+void expandRules(RangeIterator& ranges, Environment& env, const LabelTemplate& neuron_,
+                 const BoundExp& c_, const BoundExp& p_, const BoundExp& d_,
+                 vector<string>& labels, vector<Rule>& rules);
+void addRuleLabels(const vector<string>& labels, vector<Rule>& rules, const string& regex_);
+void groupRules(RuleGroups& groups, const vector<string>& labels, vector<Rule>& rules);
+void addRuleGroups(RuleGroups& groups);
+bool makeSpikeSet(const vector<Rule>& rules, SpikeSet& set);
+bool parseSpikeSet(string_view regex, SpikeSet& set);
+string spikeSetRegex(const SpikeSet& set);
+void spikeSetCounts(const SpikeSet& set, vector<long>& counts);
+long ruleLineCount(string_view regex, int c);
+void writeRuleLines(ostream& out, const string& ids, string_view regex, int c, int p, int d, bool rule_sets);
+int internRuleRegex(const string& regex, int c);
+void eval_mu(const Statement& stmt, const Environment& frame);
+void createNeurons(RangeIterator& ranges, Environment& env, const Statement& stmt, vector<string>& labels);
+void eval_ms(const Statement& stmt, const Environment& frame);
+void createSpikes(RangeIterator& ranges, Environment& env, const LabelTemplate& neuron_,
+                  bool set_spike, const BoundExp& spikes_);
+int internString(StringPool& pool, string_view str);
+int findString(const StringPool& pool, string_view str);
+int internLabel(string_view label);
+void addNeuron(int label);
+void clearNeurons();
+int findNeuron(const string& label);
+void addRule(const Rule& rule);
+void addSynapse(const Synapse& syn);
+void setSpike(const string& neuron_label, int spikes);
+void addSpike(const string& neuron_label, int spikes);
+void eval_arcs(const Statement& stmt, const Environment& frame);
+void createSynapses(RangeIterator& ranges, Environment& env, const vector<LabelTemplate>& entry);
+void addSynapses(const vector<LabelTemplate>& entry, const Environment& env);
+void expandSynapses(RangeIterator& ranges, Environment& env, const vector<LabelTemplate>& entry,
+                    vector<string>& labels);
+void addSynapseLabels(const vector<string>& labels);
+int findMethod(const string& query);
+const MathExp& compileMathExp(const string& mathexp);
+void emitOperator(MathExp& exp, char op);
+void emitOperand(MathExp& exp, const string& operand);
+int evalMathExp(const MathExp& exp, const int *values);
+int findBinding(const Environment& env, const string& label);
+BoundExp bindMathExp(const string& mathexp, const Environment& scope);
+int evalMathExp(const BoundExp& bound, const Environment& env);
+LabelTemplate compileLabel(const string& label, const Environment& scope);
+string renderLabel(const LabelTemplate& label, const Environment& env);
+RangeIterator identifyRanges(const Statement& stmt, Environment& env);
+bool affineIn(const BoundExp& bound, const vector<int>& slots);
+void openRange(RangeIterator& ranges, Environment& env, int level);
+void excludeValues(RangeIterator& ranges, Environment& env, int level);
+bool rangeAdmits(const RangeIterator& ranges, const Environment& env, int level);
+bool nextRange(RangeIterator& ranges, Environment& env);
+void sliceRange(RangeIterator& ranges, Environment& env, int begin, int end);
+int rangeSliceCount();
+bool expandInSlices(RangeIterator& ranges, Environment& env,
+                    const function<void(int, RangeIterator&, Environment&)>& expand,
+                    const function<void(int)>& merge);
 vector<string> whitespace_split(string tosplit);
-vector<string> split(string tosplit, string delimiter);
-string trim(string entry);
-string getMethodName(string buffer);
-vector<Parameter> getDefParameters(string buffer);
-vector<Parameter> getCallParameters(string buffer);
-int checkLineSpecialKeyword(string query);
-int checkLineReserveKeyword(string query);
-int checkReserveKeyword(string query);
-int checkSpecialKeyword(string query);
+vector<string> split(string_view tosplit, string_view delimiter);
+string trim(string_view entry);
+string_view trimView(string_view entry);
+bool mapSource(const char *filename, SourceFile& source);
+void unmapSource(SourceFile& source);
+int checkReserveKeyword(string_view query);
+int checkSpecialKeyword(string_view query);
 bool is_number(string s);
+bool parseInteger(const string& token, long& value);
+bool parseInt(const string& token, int& value);
 int findFromIndex(string source, string tofind, int index);
 void printMethodHolder(MethodHolder method);
 void printParameter(Parameter param);
 void printSNP();
-void outCuSnp();
+Adjacency buildAdjacency();
+void outCuSnp(bool rule_sets);
+void openSpill();
+FILE* writeSynapseRun(vector<pair<int, int> >& run);
+void outStreamCuSnp(bool rule_sets);
+bool outSNP(const char *binary_output, const char *blocks_output, bool rule_sets);
+void openFamilies();
+void openRuleSets();
+bool affineExp(const BoundExp& bound, const RangeIterator& ranges, Environment& env, int levels,
+               CuSnpAffine& affine);
+bool affineNest(const RangeIterator& ranges, Environment& env, CuSnpNest& nest);
+void nestSpans(const CuSnpNest& nest, vector<pair<long, long> >& spans);
+bool affineEndpoint(const LabelTemplate& label, const RangeIterator& ranges, Environment& env,
+                    const vector<pair<long, long> >& spans, bool rule_neuron, CuSnpAffine& affine);
+bool blockSynapses(SynapseFamily& family, CuSnpSynapseRecord& record);
+bool blockRules(RuleFamily& family, CuSnpRuleRecord& record);
+void writeSynapsePair(ostream& out, int from, int to);
+void writeRuleLine(ostream& out, int label, const string& regex, int c, int p, int d);
+void writeBlockRule(ostream& out, int label, const string& regex, int c, int p, int d);
+bool outBlocksCuSnp(const char *filename);
+bool convertBlocksToText(const char *blocks_file);
+int internRegex(CuSnpTables& tables, const string& regex);
+void tablesFromSNP(CuSnpTables& tables);
+bool tablesFromText(const char *filename, CuSnpTables& tables);
+bool writeCuSnpBinary(const char *filename, const CuSnpTables& tables);
+void outBinaryCuSnp(const char *filename);
+bool convertTextToBinary(const char *text_file, const char *binary_file);
+bool convertBinaryToText(const char *binary_file);
+bool convertRuleSetsToText(const char *text_file);
+void startThreadPool(int threads);
+void stopThreadPool();
+void workerLoop();
+void runChunks();
+void dispatchJob(long n, long chunk, const function<void(long, long)>& job);
+void parallelFor(long n, const function<void(long, long)>& job);
+string toStdRegex(const string& regex);
+void compileSimRegex(Simulator& sim, int regex, int rule);
+void compileRuleRegexes();
+bool compileProgressions(string_view regex, vector<Progression>& progressions);
+bool progressionUnion(string_view regex, size_t& pos, vector<Progression>& set);
+bool progressionTerm(string_view regex, size_t& pos, vector<Progression>& set);
+bool concatProgressions(vector<Progression>& set, const vector<Progression>& next);
+bool progressionsMatch(const Progression *progressions, int count, long spikes);
+bool regexMatches(const SimRegex& matcher, long spikes);
+bool ruleApplicable(const Simulator& sim, int rule, long spikes);
+void buildSimulator(Simulator& sim);
+void buildSpikeTables(Simulator& sim);
+bool spikeTableSpan(const Simulator& sim, long neuron, long& base, long& period);
+bool applicableRules(const Simulator& sim, long neuron, long spikes, uint64_t& mask);
+void chooseSpikingRules(Simulator& sim, long begin, long end);
+int firstApplicableRule(const Simulator& sim, long neuron, long spikes);
+void emitSpikes(const Simulator& sim, const vector<int>& spiking, vector<long>& emitted, long begin, long end);
+void applyTransition(const Simulator& sim, const vector<long>& config, const vector<int>& spiking,
+                     const vector<long>& emitted, vector<long>& next, long begin, long end);
+void accumulateScalar(const Simulator& sim, const long *emitted, long *next, long begin, long end);
+void accumulateAvx2(const Simulator& sim, const long *emitted, long *next, long begin, long end);
+void selectKernel(int kernel);
+void printConfiguration(int step, const vector<long>& config);
+void simulateSNP();
+bool insertConfiguration(ConfigSet& explored, const vector<long>& config);
+bool takeConfiguration(vector<WorkDeque>& deques, int worker, vector<long>& config);
+bool configurationHalts(const Simulator& sim, const vector<long>& config);
+void expandConfiguration(const Simulator& sim, ConfigSet& explored, const vector<long>& config,
+                         ExploreLevel& level);
+void exploreSNP();
+bool readBatch(const char *filename, vector<vector<long> >& configs);
+bool batchOutputs(const Simulator& sim, const char *labels, vector<int>& outputs);
+bool stepLanes(const Simulator& sim, const long *config, long *emitted, long *next);
+void accumulateLanesScalar(const Simulator& sim, const long *emitted, long *next);
+void accumulateLanesAvx2(const Simulator& sim, const long *emitted, long *next);
+bool simulateBatch(const char *batch_file, const char *output_labels);
+uint64_t alignBinary(FILE *file, uint64_t offset);
 void printRange(Range r);
-void printTraverseTree(TreeNode root);
+void enableStats();
+void recordPhase(const string& name, chrono::steady_clock::time_point start);
+void printStats();
+uint64_t hashBytes(const void *data, size_t size, uint64_t hash);
+string cacheKey(uint64_t hash);
+uint64_t hashTokens(const Parser& parser, size_t begin, size_t end);
+void hashMethods();
+string tempPath(const string& path);
+void openCompileCache(const char *dir, const char *filename, int steps, const char *binary_output,
+                      const char *blocks_output, bool rule_sets, bool cache_output);
+bool useCachedOutput(const char *binary_output, const char *blocks_output);
+void captureOutput(const char *binary_output, const char *blocks_output);
+void storeCachedOutput(const char *binary_output, const char *blocks_output);
+bool copyFile(const string& from, const string& to);
+void runCachedCall(const MethodHolder& method, const Environment& frame);
+int fragmentString(string_view str);
+void recordOp(initializer_list<int> op);
+void flushFragment();
+void finishFragment(const string& path);
+bool replayFragment(const string& path);
 void check(string r);
 void check();
 
@@ -141,7 +716,29 @@ int main(int argc, char *argv[]){
     return 0;
   }
 
+  //Converters between the text and binary CuSNP formats
+  string mode(argv[1]);
+  if(mode == "--to-binary" && argc > 3){
+    return convertTextToBinary(argv[2], argv[3]) ? 0 : 1;
+  } else if(mode == "--to-text" && argc > 2){
+    return convertBinaryToText(argv[2]) ? 0 : 1;
+  } else if(mode == "--expand-blocks" && argc > 2){
+    return convertBlocksToText(argv[2]) ? 0 : 1;
+  } else if(mode == "--expand-rule-sets" && argc > 2){
+    return convertRuleSetsToText(argv[2]) ? 0 : 1;
+  }
+
   char *filename = argv[1];
+  char *binary_output = NULL;
+  char *blocks_output = NULL;
+  char *cache_dir = NULL;
+  bool stream_output = false;
+  bool rule_sets = false;
+  bool simulate = false;
+  bool explore = false;
+  char *batch_file = NULL;
+  char *output_labels = NULL;
+  int threads = thread::hardware_concurrency();
 
   int steps = 0;
   //cout << "Parsing " << filename << "\n";
@@ -154,1156 +751,3668 @@ int main(int argc, char *argv[]){
           steps = stoi(val); 
         }
         
+      } else if(in == "--stream"){
+        stream_output = true;
+      } else if(in == "--rule-sets"){
+        rule_sets = true;
+      } else if(in == "--binary" && i+1 < argc){
+        binary_output = argv[i+1];
+      } else if(in == "--blocks" && i+1 < argc){
+        blocks_output = argv[i+1];
+      } else if(in == "--cache" && i+1 < argc){
+        cache_dir = argv[i+1];
+      } else if(in == "--simulate"){
+        simulate = true;
+      } else if(in == "--explore"){
+        explore = true;
+      } else if(in == "--batch" && i+1 < argc){
+        batch_file = argv[i+1];
+        simulate = true;
+      } else if(in == "--outputs" && i+1 < argc){
+        output_labels = argv[i+1];
+      } else if(in == "--stats"){
+        enableStats();
+      } else if(in == "--kernel" && i+1 < argc){
+        string val(argv[i+1]);
+        selectKernel(val == "scalar" ? KERNEL_SCALAR : val == "avx2" ? KERNEL_AVX2 : KERNEL_AUTO);
+      } else if(in == "-t" && i+1 < argc){
+        string val(argv[i+1]);
+        if(is_number(val) && !val.empty()){
+          threads = max(1, stoi(val));
+        }
       }
     }
   }
+  //The simulator and explorer need the whole system in memory
+  //Ranged statements stay symbolic for --blocks, the other outputs expand them
+  if(blocks_output != NULL && binary_output == NULL && !simulate && !explore){
+    openFamilies();
+  }
+  //Set rules are kept where rule order between neurons does not matter
+  if((rule_sets && binary_output == NULL && blocks_output == NULL) || simulate || explore){
+    openRuleSets();
+  }
+  if(cache_dir != NULL){
+    openCompileCache(cache_dir, filename, steps, binary_output, blocks_output, rule_sets,
+                     !simulate && !explore);
+    if(useCachedOutput(binary_output, blocks_output)){
+      printStats();
+      return 0;
+    }
+  }
+  //--binary is written from the in-memory model
+  if(stream_output && binary_output != NULL){
+    cerr << "--binary is written from the in-memory model, ignoring --stream\n";
+  } else if(stream_output && !simulate && !explore && blocks_output == NULL){
+    openSpill();
+  }
+  startThreadPool(max(1, threads));
   //Call main method for parsing
+  bool parsed;
   if(steps==0){  
-    parseFile(filename);
+    parsed = parseFile(filename);
   } else {
-    parseFile(filename, steps);
+    parsed = parseFile(filename, steps);
+  }
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  int status = 0;
+  if(parsed && explore){
+    exploreSNP();
+    recordPhase("explore", start);
+  } else if(parsed && batch_file != NULL){
+    if(!simulateBatch(batch_file, output_labels)){
+      status = 1;
+    }
+    recordPhase("batch", start);
+  } else if(parsed && simulate){
+    simulateSNP();
+    recordPhase("simulate", start);
+  } else if(parsed){
+    captureOutput(binary_output, blocks_output);
+    if(outSNP(binary_output, blocks_output, rule_sets)){
+      storeCachedOutput(binary_output, blocks_output);
+    } else {
+      cerr << "cannot write " << blocks_output << "\n";
+      status = 1;
+    }
+    recordPhase("output", start);
   }
+  stopThreadPool();
+  printStats();
+  return status;
 }
 
 vector<MethodHolder> methods;
+unordered_map<string, int> method_ids;
 SNP snpsystem;
+SpillStore spill;
+ThreadPool thread_pool;
+CompileCache compile_cache;
+int step_kernel = KERNEL_AUTO;
+FamilyStore families;
+Stats stats;
+CountingBuffer stdout_counter;
+unordered_map<string, regex> regex_cache;
+unordered_map<string, MathExp> mathexp_cache;
 int linecount;
 
-void parseFile(char *filename, int steps){
+bool parseFile(char *filename, int steps){
   snpsystem.simulationsteps = steps;
-  parseFile(filename);
+  return parseFile(filename);
 }
 
-void parseFile(char *filename){
+bool parseFile(char *filename){
   
   //Open and verify file integrity
-  ifstream file (filename);
-  if(!file.is_open()){
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  SourceFile source;
+  if(!mapSource(filename, source)){
     //cout << "File \"" << filename << "\" does not exist\n";
-    return;
-  }
-
-  string buffer;
-  getline(file, buffer);
-  linecount = 1;
-  //Check header
-  if(buffer != HEADER){
-    //cout << "SNP pli file must have \"" << HEADER << "\" as file header\n";
-  }
-
-  vector<MethodHolder> new_methods;
-
-  while(getline(file, buffer)){
-    linecount++;
-    if(buffer.find("def")!=string::npos){
-      MethodHolder method;
-      
-      method.label = getMethodName(buffer);
-      method.parameters = getDefParameters(buffer);
-      method.contents.push_back(buffer);
-      
-      int curlybraces = buffer.find("{");
-      stack<string> stacky;
-      stacky.push("{");
-      while(!stacky.empty() && getline(file, buffer)){
-        method.contents.push_back(buffer);
-        int openbraces = count(buffer.begin(), buffer.end(), '{');
-        int closebraces = count(buffer.begin(), buffer.end(), '}');
-        for(int i=0;i<openbraces;i++){
-          stacky.push("{");
-        }
-        for(int i=0;i<closebraces;i++){
-          stacky.pop();
-        }
-      }
-
-      new_methods.push_back(method);
-
-    }
+    return false;
   }
 
-  methods = new_methods;
-
-  MethodHolder *main;
+  methods = parseProgram(string_view(source.data, source.size));
+  unmapSource(source);
+  recordPhase("parse", start);
+  start = chrono::steady_clock::now();
+  compileProgram();
+  hashMethods();
+  recordPhase("compile", start);
 
-  /**
-  for(int i=0;i<new_methods.size();i++){
-    if(new_methods[i].label == "main"){
-      main = &new_methods[i];
-    }
+  int main = findMethod("main");
+  if(main < 0){
+    return false;
   }
-  **/
-
-  main = &methods[findMethod("main")];
-  vector<Parameter> params;
+  //main has no caller, its parameters if any are 0
+  Environment frame;
+  frame.values.assign(methods[main].parameters.size(), 0);
 
-  runMethod(*main, params);
-  outCuSnp();
+  start = chrono::steady_clock::now();
+  runMethod(methods[main], frame);
+  compileRuleRegexes();
+  recordPhase("expand", start);
   //printSNP();
+  return true;
 }
 
-void runMethod(MethodHolder method, vector<Parameter> params){
-
-  vector<string> lines;
-  for(int i=0;i<method.contents.size();i++){
-    vector<string> split_by_semicolon = split(method.contents[i], ";");   //CONSIDER:: no semicolon in a line
-    for(int j=0;j<split_by_semicolon.size();j++){
-      lines.push_back(split_by_semicolon[j]);
+//Runs a compiled method body, frame holds the values of its parameters
+void runMethod(const MethodHolder& method, const Environment& frame){
+  for(int i=0;i<method.body.size();i++){
+    const Statement& stmt = method.body[i];
+    switch(stmt.kind){
+      case STMT_CALL:
+        eval_call(stmt, frame);
+        break;
+      case STMT_MU:
+        eval_mu(stmt, frame);
+        break;
+      case STMT_MS:
+        eval_ms(stmt, frame);
+        break;
+      case STMT_ARCS:
+        eval_arcs(stmt, frame);
+        break;
+      case STMT_RULE:
+        eval_rule(stmt, frame);
+        break;
     }
   }
-  for(int i=0;i<lines.size();i++){
-    //SPECIAL KEYWORDS DEF AND CALL
-    int special_index = checkLineSpecialKeyword(lines[i]);
-    if(special_index > 0){
-      //cout << "Theres a keyword"<<endl;
-      switch(special_index){
-        case SPECIAL_DEF_INDEX:
-          //cout << "DEF METHOD" << endl;
-          break;
-        case SPECIAL_CALL_INDEX:
-          vector<Parameter> new_parameters = getCallParameters(lines[i]);
-          string method_to_call = getMethodName(lines[i]);
-          runMethod(methods[findMethod(method_to_call)], new_parameters);
-          break;
-        
-      }
-    }
-    int reserve_index = checkLineReserveKeyword(lines[i]);
-    if(reserve_index >= 0){
-      switch(reserve_index){
-        case INDEX_MU:
-          eval_mu(lines[i], method, params);
-          break;
-        case INDEX_MS:
-          eval_ms(lines[i], method, params);
-          break;
-        case INDEX_ARCS:
-          eval_arcs(lines[i], method, params);
-          break;
+}
+
+//Splits the source into tokens in one pass. Statements end at ';' or at the
+//end of their line, both become a single TOK_END
+void lexSource(string_view source, vector<Token>& tokens){
+  tokens.reserve(source.length()/2);
+  int line = 1;
+  size_t i = 0;
+  while(i < source.length()){
+    char currchar = source[i];
+    if(currchar == '\n' || currchar == ';'){
+      if(!tokens.empty() && tokens.back().kind != TOK_END){
+        Token token;
+        token.kind = TOK_END;
+        token.text = source.substr(i, 1);
+        token.line = line;
+        tokens.push_back(token);
       }
+      if(currchar == '\n') line++;
+      i++;
+      continue;
     }
-    int open_square = lines[i].find("[");
-    int close_square = lines[i].find("]");
-    int alpha_a = lines[i].find("a");
-
-    if(open_square!=string::npos && close_square!=string::npos && alpha_a!=string::npos 
-      && open_square<alpha_a && alpha_a<close_square){
-      parseRule(lines[i], method, params);
+    if(isspace((unsigned char)currchar)){
+      i++;
+      continue;
     }
-  }
-}
-
-void parseRule(string line, MethodHolder method, vector<Parameter> params){
-  line = matchParameters(line, method.parameters, params);
-  
-  string delay_;
-  string neuron_;
-  string range_ = "";
-  string regex_ = "";
-  stack<char> parse_stack;
-  vector<string> spike_buffer;
-
-  for(int i=0;i<line.length();i++){
-    char currchar = line.at(i);
-    //cout << "CURR: " << currchar << endl;
-    if(currchar == 'a'){
+    Token token;
+    token.line = line;
+    size_t start = i;
+    if(isalpha((unsigned char)currchar) || currchar == '_' || currchar == '@'){
+      token.kind = currchar == '@' ? TOK_KEYWORD : TOK_IDENT;
       i++;
-      if(line.at(i) == '*'){
-        i++;
-        stringstream buffer;
-        if(line.at(i) == '('){
-          i++;
-          while(line.at(i) != ')'){
-            buffer << line.at(i);
-            i++;
-          }
-        } else {
-          while(line.at(i) != ' ' && line.at(i) != ']'){
-            buffer << line.at(i);
-            i++;
-          }
-          if(line.at(i) == ']') i--;
-        }
-        spike_buffer.push_back(buffer.str());
-      } else {
-        spike_buffer.push_back("1");
-      }
-    } else if(currchar == '#'){
-      spike_buffer.push_back("#");
-    } else if(currchar == '\''){
+      while(i < source.length() && (isalnum((unsigned char)source[i]) || source[i] == '_')) i++;
+    } else if(isdigit((unsigned char)currchar)){
+      token.kind = TOK_NUMBER;
+      while(i < source.length() && isdigit((unsigned char)source[i])) i++;
+    } else if(currchar == '\"'){
+      token.kind = TOK_STRING;
+      start = ++i;
+      while(i < source.length() && source[i] != '\"' && source[i] != '\n') i++;
+      token.text = source.substr(start, i-start);
+      if(i < source.length() && source[i] == '\"') i++;
+      tokens.push_back(token);
+      continue;
+    } else {
+      token.kind = TOK_SYMBOL;
       i++;
-      stringstream buffer;
-      while(i < line.length() && line.at(i) != ' ' && line.at(i) != ':'){
-        buffer << line.at(i);
-        i++;
-      }
-      neuron_ = buffer.str();
-      if(i < line.length() && line.at(i) == ':') i--;
-    } else if(currchar == ':'){
-      bool range = false;
-      if(line.at(i+1) == ':'){
-        i+=2;
-        stringstream delay_exp;
-        while(i < line.length() && line.at(i) != ':'){
-          delay_exp << line.at(i);
-          i++;
-        }
-        delay_ = delay_exp.str();
-        if((i+1)!=line.length()){
-          range = true;
+      for(int j=0;j<SYMBOL_COUNT;j++){
+        if(source.substr(start, SYMBOLS[j].length()) == SYMBOLS[j]){
+          i = start + SYMBOLS[j].length();
+          break;
         }
-      } else {
-        range = true;
-      }
-      if(range){
-        range_ = line.substr(i+1, line.length());
-        i+=range_.length();
       }
-    } else if(currchar == '\"'){
-      i++;currchar = line.at(i);
-      stringstream regex;
-      while(currchar!='\"'){
-        regex << currchar;
-        i++;currchar = line.at(i);
-      }
-      regex_ = regex.str();
     }
+    token.text = source.substr(start, i-start);
+    tokens.push_back(token);
   }
+  Token eof;
+  eof.kind = TOK_EOF;
+  eof.line = line;
+  tokens.push_back(eof);
+}
 
-  if(!range_.empty()){
-    
-    TreeNode root;
-    root.label = "root";
-    root.value = -1;
-    root.parent = NULL;
-
-    identifyRanges(range_, root);
-
-    createRules(root, neuron_, regex_, spike_buffer[0], spike_buffer[1], delay_);
+bool isSymbol(const Token& token, string_view symbol){
+  return token.kind == TOK_SYMBOL && token.text == symbol;
+}
 
-  } else {
-    Rule rule;
-    rule.neuron_label = neuron_;
-    rule.d = evalMathExp(delay_);
-    rule.c = evalMathExp(spike_buffer[0]);
-    rule.p = evalMathExp(spike_buffer[1]);
-    if(regex_.empty()){
-      stringstream rbuff;
-      rbuff << "a" << rule.c;
-      regex_ = rbuff.str();  
-    }
-    rule.regex = regex_;
-    snpsystem.rules.push_back(rule);
+//Consumes the next token if it is the given symbol
+bool acceptSymbol(Parser& parser, string_view symbol){
+  if(isSymbol(parser.tokens[parser.pos], symbol)){
+    parser.pos++;
+    return true;
   }
+  return false;
 }
 
-void createRules(TreeNode &node, string neuron_, string regex_, string c_, string p_, string d_){
-  if(node.children.empty()){
-    Rule rule;
-    vector<Parameter> params;
-    TreeNode *curr = &node;
-    while(curr->label != "root"){
-      Parameter p;
-      p.label = curr->label;
-      p.value = curr->value;
-      params.push_back(p);
-      curr = curr->parent;
-    }
-    rule.neuron_label = matchParameters(neuron_, params);
-    string c_exp = subsMathExp(c_, params);
-    string p_exp = subsMathExp(p_, params);
-    string d_exp = subsMathExp(d_, params);
-    rule.c = evalMathExp(c_exp);
-    rule.p = evalMathExp(p_exp);    
-    rule.d = evalMathExp(d_exp);
-    if(regex_.empty()){
-      stringstream rbuff;
-      rbuff << "a" << rule.c;
-      regex_ = rbuff.str();  
-    }
-    rule.regex = regex_;
-    snpsystem.rules.push_back(rule);
-  } else {
-    for(int i=0;i<node.children.size();i++){
-      createRules(node.children[i], neuron_, regex_, c_, p_, d_);
-    }
+//Consumes the next token if it is the identifier a, the spike symbol
+bool acceptSpike(Parser& parser){
+  const Token& token = parser.tokens[parser.pos];
+  if(token.kind == TOK_IDENT && token.text == "a"){
+    parser.pos++;
+    return true;
   }
+  return false;
 }
 
-void eval_mu(string line, MethodHolder method, vector<Parameter> params){
-  string keyword = RESERVE_KEYWORDS[checkReserveKeyword("@mu")];
-  line = matchParameters(line, method.parameters, params);
-
-  int mu_index = line.find(keyword);
-  string substr = line.substr(mu_index+keyword.length(), line.length());
-
-  vector<string> colon_split = split(substr, ":");
-  //Case: Range is specified
-  if(colon_split.size() > 1){
-    TreeNode root;
-    root.label = "root";
-    root.value = -1;
-    root.parent = NULL;
-    
-    identifyRanges(colon_split[1], root);
-
-    //printTraverseTree(root);
-
-    //Check Expression for = | +=
-    bool is_newrons = false;
-    string buffer = trim(colon_split[0]);
-    int delim = buffer.find("+=");
-    if(delim==string::npos){
-      is_newrons = true;
-      buffer = trim(buffer.substr(1, buffer.length()));
-    } else {
-      buffer = trim(buffer.substr(2, buffer.length()));
-    }
-
-    //Identify neurons to be created
-    vector<string> comma_split = split(buffer, ",");
-    vector<Neuron> temp_neurons;
-    for(int i=0;i<comma_split.size();i++){
-      string label;
-      int openbraces = comma_split[i].find("{");
-      int closebraces;
-      if(openbraces!=string::npos){                           //EVALUATE MATH EXPRESSION
-        label = comma_split[i].substr(0, openbraces);
-        closebraces = comma_split[i].find("}");
-        Neuron temp;
-        temp.label = label;
-        temp.param.label = comma_split[i].substr(openbraces+1, closebraces-openbraces-1);
-        temp_neurons.push_back(temp);
-      }                                                       //LIMITATION: Neuron without {}
-    }
+bool atStatementEnd(const Parser& parser){
+  const Token& token = parser.tokens[parser.pos];
+  return token.kind == TOK_END || token.kind == TOK_EOF || isSymbol(token, "}");
+}
 
-    vector<Neuron> new_rons;
-    recursiveCreateNeurons(root, new_rons, temp_neurons);
+//Source text covered by tokens [begin, end)
+string tokenText(const Parser& parser, size_t begin, size_t end){
+  if(begin >= end){
+    return "";
+  }
+  const Token& first = parser.tokens[begin];
+  const Token& last = parser.tokens[end-1];
+  return string(first.text.data(), last.text.data()+last.text.size()-first.text.data());
+}
 
-    //Evaluation for expression: += | =
-    if(is_newrons){
-      snpsystem.neurons = new_rons;
-    } else {
-      for(int i=0;i<new_rons.size();i++){
-        snpsystem.neurons.push_back(new_rons[i]);
-      }
+//Collects tokens up to the first stop symbol outside brackets and returns their
+//source text. A statement end or an unmatched closing bracket always stops it,
+//"\"" among the stops stops at a string
+string parseSpan(Parser& parser, const vector<string_view>& stops){
+  size_t begin = parser.pos;
+  int depth = 0;
+  while(!atStatementEnd(parser) || (depth > 0 && isSymbol(parser.tokens[parser.pos], "}"))){
+    const Token& token = parser.tokens[parser.pos];
+    if(depth == 0 && token.kind == TOK_STRING && find(stops.begin(), stops.end(), "\"") != stops.end()){
+      break;
     }
-
-  }
-  //Case: No Range Specified
-  else{
-    if(colon_split[0].find("{")!=string::npos){
-      //cout << "Error: No Range given. Line:" << line << endl;
-    }
-    int delim =  colon_split[0].find("+=");
-    if(delim != string::npos){
-      string label = trim(colon_split[0].substr(delim+3, colon_split[0].length()));
-      vector<string> comma_split = split(label, ",");
-      for(int i=0;i<comma_split.size();i++){
-        Neuron new_ron;
-        new_ron.label = trim(comma_split[i]);
-        new_ron.spikes = 0;
-        snpsystem.neurons.push_back(new_ron);
+    if(token.kind == TOK_SYMBOL){
+      if(depth == 0 && find(stops.begin(), stops.end(), token.text) != stops.end()){
+        break;
       }
-    } else {
-      delim = colon_split[0].find("=");
-      string label = trim(colon_split[0].substr(delim+2, colon_split[0].length()));
-      vector<Neuron> new_rons;
-      vector<string> comma_split = split(label, ",");
-      for(int i=0;i<comma_split.size();i++){
-        Neuron new_ron;
-        new_ron.label = trim(comma_split[i]);
-        new_ron.spikes = 0;
-        new_rons.push_back(new_ron);
-      }
-      snpsystem.neurons = new_rons;
-    }
-  }
-}
-
-//Create Tree to Represent Range values
-void recursiveCreateNeurons(TreeNode& node, vector<Neuron>& neurons, vector<Neuron>& temp){
-  if(node.children.empty()){
-    TreeNode *curr = &node;
-    while(curr->parent!=NULL){
-      for(int i=0;i<temp.size();i++){
-        if(temp[i].param.label==curr->label){
-          Neuron new_ron;
-          stringstream ss;
-          ss << temp[i].label << "{" << curr->value << "}";
-          new_ron.label = ss.str();
-          new_ron.spikes = 0;
-          neurons.push_back(new_ron);
+      if(token.text == "(" || token.text == "[" || token.text == "{"){
+        depth++;
+      } else if(token.text == ")" || token.text == "]" || token.text == "}"){
+        if(depth == 0){
+          break;
         }
+        depth--;
       }
-      curr = curr->parent;
-    }
-  }else{
-    for(int i=0;i<node.children.size();i++){
-      recursiveCreateNeurons(node.children[i], neurons, temp);
     }
+    parser.pos++;
   }
+  return tokenText(parser, begin, parser.pos);
 }
 
-void eval_ms(string line, MethodHolder method, vector<Parameter> params){
-  string keyword = RESERVE_KEYWORDS[checkReserveKeyword("@ms")];
-  line = trim(line);
-  if(!params.empty()){
-    line = matchParameters(line, method.parameters, params);
+//Skips the rest of a statement, leaving a closing } of the body in place
+void skipStatement(Parser& parser){
+  int depth = 0;
+  while(parser.tokens[parser.pos].kind != TOK_EOF){
+    const Token& token = parser.tokens[parser.pos];
+    if(depth == 0 && (token.kind == TOK_END || isSymbol(token, "}"))){
+      break;
+    }
+    if(isSymbol(token, "{")) depth++;
+    if(isSymbol(token, "}")) depth--;
+    parser.pos++;
   }
-  vector<string> colon_split = split(line, ":");
-  if(colon_split.size()>1){
-    TreeNode root;
-    root.value = -1;
-    root.label = "root";
-
-    identifyRanges(colon_split[1], root);
+}
 
-    recursiveCreateSpikes(root, colon_split[0]);
-  } else {
-    string neuron_label = line.substr(4, line.find(")")-4);
-    bool set_spike = (line.find("+=") == string::npos);
-    string mathexp = line.substr(line.find("a*"), line.length());
-    mathexp = mathexp.substr(2, mathexp.length()-2);
-    int mathexpresult = evalMathExp(mathexp);
-    if(set_spike){
-      setSpike(neuron_label, mathexpresult);
+//Parses a range list: bounds x1 <= i <= x2, where either side may use <, <=
+//or =<, and exceptions e1 <> e2
+//returns false on a malformed entry
+bool parseRanges(Parser& parser, Statement& stmt){
+  stmt.has_range = true;
+  do{
+    size_t begin = parser.pos;
+    parseSpan(parser, {","});
+    size_t end = parser.pos;
+    vector<size_t> relations;
+    int depth = 0;
+    for(size_t i=begin;i<end;i++){
+      const Token& token = parser.tokens[i];
+      if(isSymbol(token, "(")) depth++;
+      if(isSymbol(token, ")")) depth--;
+      if(depth == 0 && (isSymbol(token, "<=") || isSymbol(token, "=<") ||
+                        isSymbol(token, "<") || isSymbol(token, "<>"))){
+        relations.push_back(i);
+      }
+    }
+    Range range;
+    if(relations.size() == 1 && isSymbol(parser.tokens[relations[0]], "<>")){
+      range.x1 = tokenText(parser, begin, relations[0]);
+      range.x2 = tokenText(parser, relations[0]+1, end);
+      stmt.exceptions.push_back(range);
+    } else if(relations.size() == 2 && relations[1] == relations[0]+2 &&
+              parser.tokens[relations[0]+1].kind == TOK_IDENT &&
+              !isSymbol(parser.tokens[relations[0]], "<>") && !isSymbol(parser.tokens[relations[1]], "<>")){
+      range.x1 = tokenText(parser, begin, relations[0]);
+      range.inclusive_x1 = !isSymbol(parser.tokens[relations[0]], "<");
+      range.label = string(parser.tokens[relations[0]+1].text);
+      range.x2 = tokenText(parser, relations[1]+1, end);
+      range.inclusive_x2 = !isSymbol(parser.tokens[relations[1]], "<");
+      stmt.ranges.push_back(range);
     } else {
-      addSpike(neuron_label, mathexpresult);
+      return false;
     }
-  }
-
+  } while(acceptSymbol(parser, ","));
+  return true;
 }
 
-void recursiveCreateSpikes(TreeNode node, string entry){
-
-  for(int i=0;i<node.children.size();i++){
-    recursiveCreateSpikes(node.children[i], entry);
+//@mu = | += label, label... [: ranges]
+//With a range only label{variable} entries create neurons
+bool parseMu(Parser& parser, Statement& stmt){
+  stmt.kind = STMT_MU;
+  stmt.append = acceptSymbol(parser, "+=");
+  if(!stmt.append && !acceptSymbol(parser, "=")){
+    return false;
   }
-
-  TreeNode *curr = &node;
-
-  if(node.children.empty()){
-    vector<Parameter> params;
-    while(curr->label != "root"){
-      Parameter new_param;
-      new_param.label = curr->label;
-      new_param.value = curr->value;
-      params.push_back(new_param);
-      curr = curr->parent;
+  do{
+    string label = parseSpan(parser, {",", ":"});
+    if(!label.empty()){
+      stmt.labels.push_back(label);
     }
-    string to_eval = matchParameters(entry, params);
-    string neuron_label = to_eval.substr(4, to_eval.find(")")-4);
-    bool set_spike = (to_eval.find("+=") == string::npos);
-    string mathexp = to_eval.substr(to_eval.find("a*("), to_eval.length());
-    mathexp = mathexp.substr(2, mathexp.length()-2);
-    int mathexpresult = evalMathExp(mathexp);
-    if(set_spike){
-      setSpike(neuron_label, mathexpresult);
-    } else {
-      addSpike(neuron_label, mathexpresult);
+  } while(acceptSymbol(parser, ","));
+  if(acceptSymbol(parser, ":")){
+    if(!parseRanges(parser, stmt)){
+      return false;
+    }
+    vector<string> labels;
+    for(int i=0;i<stmt.labels.size();i++){
+      size_t open = stmt.labels[i].find("{");
+      if(open != string::npos){
+        size_t close = stmt.labels[i].find("}");
+        labels.push_back(stmt.labels[i].substr(0, open));
+        stmt.label_vars.push_back(stmt.labels[i].substr(open+1, close-open-1));
+      }
     }
+    stmt.labels = labels;
   }
+  return true;
 }
 
-void setSpike(string neuron_label, int spikes){
-  for(int i=0;i<snpsystem.neurons.size();i++){
-    if(snpsystem.neurons[i].label == neuron_label){
-      snpsystem.neurons[i].spikes = spikes;
-    }
+//@ms(label) = | += a*spikes [: ranges]
+bool parseMs(Parser& parser, Statement& stmt){
+  stmt.kind = STMT_MS;
+  if(!acceptSymbol(parser, "(")){
+    return false;
+  }
+  stmt.labels.push_back(parseSpan(parser, {}));
+  if(!acceptSymbol(parser, ")")){
+    return false;
+  }
+  stmt.append = acceptSymbol(parser, "+=");
+  if(!stmt.append && !acceptSymbol(parser, "=")){
+    return false;
+  }
+  if(!acceptSpike(parser)){
+    return false;
   }
+  stmt.spikes = acceptSymbol(parser, "*") ? parseSpan(parser, {":"}) : "1";
+  if(acceptSymbol(parser, ":")){
+    return parseRanges(parser, stmt);
+  }
+  return true;
 }
 
-void addSpike(string neuron_label, int spikes){
-  for(int i=0;i<snpsystem.neurons.size();i++){
-    if(snpsystem.neurons[i].label == neuron_label){
-      snpsystem.neurons[i].spikes += spikes;
+//@marcs = | += (from, to), (from, to)... [: ranges]
+bool parseArcs(Parser& parser, Statement& stmt){
+  stmt.kind = STMT_ARCS;
+  stmt.append = acceptSymbol(parser, "+=");
+  if(!stmt.append && !acceptSymbol(parser, "=")){
+    return false;
+  }
+  do{
+    if(!acceptSymbol(parser, "(")){
+      return false;
+    }
+    stmt.labels.push_back(parseSpan(parser, {","}));
+    if(!acceptSymbol(parser, ",")){
+      return false;
+    }
+    stmt.labels.push_back(parseSpan(parser, {}));
+    if(!acceptSymbol(parser, ")")){
+      return false;
     }
+  } while(acceptSymbol(parser, ","));
+  if(acceptSymbol(parser, ":")){
+    return parseRanges(parser, stmt);
   }
+  return true;
 }
 
-void eval_arcs(string line, MethodHolder method, vector<Parameter> params){
-  line = matchParameters(line, method.parameters, params);
-  vector<string> colon_split = split(line, ":");
-
-  if(colon_split.size()>1){
-
-    TreeNode root;
-    root.label = "root";
-    root.value = -1;
-    identifyRanges(colon_split[1], root);
-
-    bool set_synapses = (colon_split[0].find("+=")==string::npos);
-    recursiveCreateSynapses(root, colon_split[0]);
+//["regex"] [a[*c] --> a[*p] | #]'label ["regex"] [:: delay] [: ranges]
+bool parseRule(Parser& parser, Statement& stmt){
+  stmt.kind = STMT_RULE;
+  if(parser.tokens[parser.pos].kind == TOK_STRING){
+    stmt.regex = string(parser.tokens[parser.pos++].text);
+  }
+  if(!acceptSymbol(parser, "[") || !acceptSpike(parser)){
+    return false;
+  }
+  stmt.spikes = acceptSymbol(parser, "*") ? parseSpan(parser, {"-->"}) : "1";
+  if(!acceptSymbol(parser, "-->")){
+    return false;
+  }
+  if(acceptSymbol(parser, "#")){
+    stmt.produced = "0";
+  } else if(acceptSpike(parser)){
+    stmt.produced = acceptSymbol(parser, "*") ? parseSpan(parser, {}) : "1";
   } else {
-    addSynapse(colon_split[0]);
+    return false;
+  }
+  if(!acceptSymbol(parser, "]") || !acceptSymbol(parser, "'")){
+    return false;
+  }
+  stmt.labels.push_back(parseSpan(parser, {"\"", ":", "::"}));
+  while(!atStatementEnd(parser)){
+    if(parser.tokens[parser.pos].kind == TOK_STRING){
+      stmt.regex = string(parser.tokens[parser.pos++].text);
+    } else if(acceptSymbol(parser, "::")){
+      stmt.delay = parseSpan(parser, {":", "\""});
+    } else if(acceptSymbol(parser, ":")){
+      return parseRanges(parser, stmt);
+    } else {
+      return false;
+    }
   }
+  return true;
 }
 
-void recursiveCreateSynapses(TreeNode node, string entry){
-  for(int i=0;i<node.children.size();i++){
-    recursiveCreateSynapses(node.children[i], entry);
+//call method(expression, expression...)
+bool parseCall(Parser& parser, Statement& stmt){
+  stmt.kind = STMT_CALL;
+  if(parser.tokens[parser.pos].kind != TOK_IDENT){
+    return false;
   }
-
-  TreeNode *curr = &node;
-
-  if(node.children.empty()){
-    vector<Parameter> params;
-    while(curr->label != "root"){
-      Parameter new_param;
-      new_param.label = curr->label;
-      new_param.value = curr->value;
-      params.push_back(new_param);
-      curr = curr->parent;
+  stmt.name = string(parser.tokens[parser.pos++].text);
+  if(!acceptSymbol(parser, "(")){
+    return false;
+  }
+  if(!acceptSymbol(parser, ")")){
+    do{
+      stmt.args.push_back(parseSpan(parser, {","}));
+    } while(acceptSymbol(parser, ","));
+    if(!acceptSymbol(parser, ")")){
+      return false;
     }
-    string to_eval = matchParameters(entry, params);
-    addSynapse(to_eval);
   }
+  return true;
 }
 
-void addSynapse(string entry){
-  string buffer = entry;
-  int open_index = buffer.find("(");
-  while(open_index != string::npos){
-    buffer = buffer.substr(open_index+1, buffer.length());
-    int comma_index = buffer.find(",");
-    int close_index = buffer.find(")");
-    string neuron_1 = trim(buffer.substr(0, comma_index));
-    string neuron_2 = trim(buffer.substr(comma_index+1, close_index - comma_index - 1));
-    open_index = buffer.find("(");
-    Synapse syn;
-    syn.from = neuron_1;
-    syn.to = neuron_2;
-    snpsystem.synapses.push_back(syn);
+//Parses one statement of a method body
+//Statements that are not understood are skipped like before, @masynch, @mseq,
+//@min and @mout have no CuSNP counterpart and are skipped as well
+bool parseStatement(Parser& parser, Statement& stmt){
+  const Token& token = parser.tokens[parser.pos];
+  stmt.line = token.line;
+  bool parsed = true;
+  if(token.kind == TOK_IDENT && checkSpecialKeyword(token.text) == SPECIAL_CALL_INDEX){
+    parser.pos++;
+    parsed = parseCall(parser, stmt);
+  } else if(token.kind == TOK_KEYWORD && checkReserveKeyword(token.text) == INDEX_MU){
+    parser.pos++;
+    parsed = parseMu(parser, stmt);
+  } else if(token.kind == TOK_KEYWORD && checkReserveKeyword(token.text) == INDEX_MS){
+    parser.pos++;
+    parsed = parseMs(parser, stmt);
+  } else if(token.kind == TOK_KEYWORD && checkReserveKeyword(token.text) == INDEX_ARCS){
+    parser.pos++;
+    parsed = parseArcs(parser, stmt);
+  } else if(isSymbol(token, "[") || token.kind == TOK_STRING){
+    parsed = parseRule(parser, stmt);
+  } else {
+    skipStatement(parser);
+    return true;
+  }
+  if(!parsed || !atStatementEnd(parser)){
+    stmt.kind = STMT_NONE;
+    skipStatement(parser);
+    return false;
   }
+  return true;
 }
 
-
-//Finds the index of the method in MethodHolder list given a string query
-//returns -1 if method does not exist
-int findMethod(string query){
-  for(int i=0;i<methods.size();i++){
-    if(methods[i].label == query){
-      return i;
+//Upper bound on the statements left in the body being parsed
+size_t countStatements(const Parser& parser){
+  size_t count = 0;
+  int depth = 0;
+  for(size_t i=parser.pos;parser.tokens[i].kind != TOK_EOF;i++){
+    if(parser.tokens[i].kind == TOK_END){
+      count++;
+    } else if(isSymbol(parser.tokens[i], "{")){
+      depth++;
+    } else if(isSymbol(parser.tokens[i], "}") && --depth < 0){
+      break;
     }
   }
-  return -1;
+  return count+1;
 }
 
-int evalMathExp(string mathexp){
-  vector<string> postfix_notation;
-  stack<char> opstack;
-
-  if(trim(mathexp).empty() || trim(mathexp) == "#"){
-    return 0;
-  }  
-  for(int i=0;i<mathexp.length();i++){
-    char currchar = mathexp.at(i);
-    if(currchar=='+'){
-      while(!opstack.empty() && (opstack.top() == '+' || opstack.top() == '-' || opstack.top() =='/' ||
-           opstack.top() =='*' || opstack.top()=='^')){
-        string opp(1, opstack.top());
-        postfix_notation.push_back(opp);
-        opstack.pop();
-      }
-      opstack.push('+');
-    } else if(currchar=='-'){
-      while(!opstack.empty() && (opstack.top() == '-' || opstack.top() =='/' ||
-           opstack.top() =='*' || opstack.top() =='^')){
-        string opp(1, opstack.top());
-        postfix_notation.push_back(opp);
-        opstack.pop();
-      }
-      opstack.push('-');
-    } else if(currchar=='/'){
-      while(!opstack.empty() && (opstack.top() == '/' || opstack.top() == '*' || opstack.top() == '^')){
-        string opp(1, opstack.top());
-        postfix_notation.push_back(opp);
-        opstack.pop();
-      }
-      opstack.push('/');
-    } else if(currchar=='*'){
-      while(!opstack.empty() && (opstack.top() == '*' || opstack.top() == '^')){
-        string opp(1, opstack.top());
-        postfix_notation.push_back(opp);
-        opstack.pop();
-      }
-      opstack.push('*');
-    } else if(currchar=='^'){
-      while(!opstack.empty() && (opstack.top() == '^')){
-        string opp(1, opstack.top());
-        postfix_notation.push_back(opp);
-        opstack.pop();
-      }
-      opstack.push('^');
-    } else if(currchar=='('){
-      opstack.push('(');
-    } else if(currchar==')'){
-      while(opstack.top()!='('){
-        string opp(1, opstack.top());
-        postfix_notation.push_back(opp);
-        opstack.pop();
-      }
-      opstack.pop();
-    } else if(currchar==' '){
-      //donothing
-    } else {
-      stringstream operand_buffer;
-      operand_buffer << currchar;
-      while( (i+1) < mathexp.length() && mathexp.at(i+1) != '+' && mathexp.at(i+1) != '-' &&
-            mathexp.at(i+1) != '*' && mathexp.at(i+1) != '/' &&
-            mathexp.at(i+1) != '^' && mathexp.at(i+1) != '(' &&
-            mathexp.at(i+1) != ')' && mathexp.at(i+1) != ' '){
-        
-        currchar = mathexp.at(i+1);
-        operand_buffer << currchar;
-        i++;      
-      }
-      postfix_notation.push_back(operand_buffer.str());
+//def name(parameter, parameter...){ statements }
+bool parseDef(Parser& parser, MethodHolder& method){
+  size_t first = parser.pos;
+  if(parser.tokens[parser.pos].kind != TOK_IDENT){
+    return false;
+  }
+  method.label = string(parser.tokens[parser.pos++].text);
+  if(!acceptSymbol(parser, "(")){
+    return false;
+  }
+  while(parser.tokens[parser.pos].kind == TOK_IDENT){
+    Parameter param;
+    param.label = string(parser.tokens[parser.pos++].text);
+    param.value = -1;
+    method.parameters.push_back(param);
+    if(!acceptSymbol(parser, ",")){
+      break;
     }
   }
-  
-  while(!opstack.empty()){
-    string opp(1, opstack.top());
-    postfix_notation.push_back(opp);
-    opstack.pop();
+  if(!acceptSymbol(parser, ")")){
+    return false;
   }
-  
-  stack<int> evalstack;
-  for(int i=0;i<postfix_notation.size();i++){
-    if(postfix_notation[i]=="+"){
-      int op_a = evalstack.top(); evalstack.pop();
-      int op_b = evalstack.top(); evalstack.pop();
-      evalstack.push(op_a+op_b);
-    } else if(postfix_notation[i]=="-"){
-      int op_a = evalstack.top(); evalstack.pop();
-      int op_b = evalstack.top(); evalstack.pop();
-      evalstack.push(op_b-op_a);
-    } else if(postfix_notation[i]=="*"){
-      int op_a = evalstack.top(); evalstack.pop();
-      int op_b = evalstack.top(); evalstack.pop();
-      evalstack.push(op_a*op_b);
-    } else if(postfix_notation[i]=="/"){
-      int op_a = evalstack.top(); evalstack.pop();
-      int op_b = evalstack.top(); evalstack.pop();
-      evalstack.push(op_b/op_a);
-    } else if(postfix_notation[i]=="^"){
-      int op_a = evalstack.top(); evalstack.pop();
-      int op_b = evalstack.top(); evalstack.pop();
-      evalstack.push(pow(op_b, op_a));
+  while(parser.tokens[parser.pos].kind == TOK_END){
+    parser.pos++;
+  }
+  if(!acceptSymbol(parser, "{")){
+    return false;
+  }
+  method.body.reserve(countStatements(parser));
+  while(parser.tokens[parser.pos].kind != TOK_EOF){
+    if(parser.tokens[parser.pos].kind == TOK_END){
+      parser.pos++;
+    } else if(acceptSymbol(parser, "}")){
+      method.source_hash = hashTokens(parser, first, parser.pos);
+      return true;
     } else {
-      evalstack.push(stoi(postfix_notation[i]));
+      Statement stmt;
+      if(!parseStatement(parser, stmt)){
+        cerr << "line " << stmt.line << ": malformed statement ignored\n";
+      } else if(stmt.kind != STMT_NONE){
+        method.body.push_back(move(stmt));
+      }
     }
   }
-  
-  return evalstack.top();
+  return true;
 }
 
-string subsMathExp(string line, vector<Parameter> params){
-  string buffer = ":";
-  buffer.append(line);
-  buffer = matchParameters(buffer, params);
-  return buffer.substr(1, buffer.length());
+//Parses every def of a source file, anything outside of them is skipped
+vector<MethodHolder> parseProgram(string_view source){
+  Parser parser;
+  lexSource(source, parser.tokens);
+  vector<MethodHolder> program;
+  while(parser.tokens[parser.pos].kind != TOK_EOF){
+    const Token& token = parser.tokens[parser.pos++];
+    if(token.kind == TOK_IDENT && checkSpecialKeyword(token.text) == SPECIAL_DEF_INDEX){
+      MethodHolder method;
+      if(parseDef(parser, method)){
+        program.push_back(move(method));
+      } else {
+        cerr << "line " << token.line << ": malformed def ignored\n";
+      }
+    }
+  }
+  return program;
 }
 
-//Given a line in pli file, matches parameters for modular style programming
-string matchParameters(string line, vector<Parameter> params){
-  vector<Parameter> param_needed;
-  vector<Parameter> param_provided;
-  for(int i=0;i<params.size();i++){
-    Parameter p_need;
-    Parameter p_provide;
-    p_need.label = params[i].label;
-    p_provide.value = params[i].value;
-    param_needed.push_back(p_need);
-    param_provided.push_back(p_provide);
+//Builds the method table and binds every statement of every def once, so
+//running a body never looks at labels or expression text again
+void compileProgram(){
+  method_ids.clear();
+  for(int i=0;i<methods.size();i++){
+    method_ids.emplace(methods[i].label, i);
+  }
+  for(int i=0;i<methods.size();i++){
+    compileMethod(methods[i]);
   }
-  return matchParameters(line, param_needed, param_provided);
 }
 
-//Overloaded method
-string matchParameters(string line, vector<Parameter> param_needed, vector<Parameter> param_provided){
-  if(param_needed.size()!=param_provided.size()){
-    //cout << "Parameters do not match: " << line << endl;
-    return "";
-  }
-  
-  stringstream sstream;
-  bool after_colon = false;
-  stack<char> expression_stack;
-  stringstream buffer;
-  int colon_index = line.find(':');
-  
-  for(int iter=0;iter<line.length();iter++){
-    switch(line.at(iter)){
-      case ':':
-        expression_stack.push(':');
-        sstream << ':';
-        break;
-      case '{':
-        expression_stack.push('{');
-        sstream << '{';
-        break;
-      case ')':
-        if(!expression_stack.empty() && expression_stack.top() == 'a'){
-          expression_stack.pop();
-          goto marker;
-        } else {
-          sstream << ')';
-          break;
-        }
-      case '}':
-        expression_stack.pop();
-        goto marker;
-      case '*':
-        if(line.at(iter) == '*' && line.at(iter+1) == '(' && line.at(iter-1) == 'a'){
-          expression_stack.push('a');
-          sstream << "*(";
-          iter++;
-          break;
-        }
-      case '+': case '-': case '/': case '>': 
-      case '<': case '=': case ' ': case ',':
-        marker:
-        if(buffer.rdbuf()->in_avail()>0){
-          bool param_match = false;
-          for(int params_iter=0;params_iter<param_needed.size();params_iter++){
-            if(buffer.str()==param_needed[params_iter].label){
-              sstream << to_string(param_provided[params_iter].value);
-              param_match = true;
-            }
-          }
-          if(!param_match){
-            sstream << buffer.str();
-          }
-          buffer.str("");
-          buffer.clear();
-        }
-        sstream << line.at(iter);
-        break;
-      default:
-        if(expression_stack.empty()){
-          sstream << line.at(iter);
-        } else{
-          buffer << line.at(iter);
-        }
-        break;
-    }
+void compileMethod(MethodHolder& method){
+  Environment scope;
+  for(int i=0;i<method.parameters.size();i++){
+    scope.labels.push_back(method.parameters[i].label);
+    scope.values.push_back(0);
   }
-  if(buffer.rdbuf()->in_avail()>0){
-    bool param_match = false;
-    for(int params_iter=0;params_iter<param_needed.size();params_iter++){
-      if(buffer.str()==param_needed[params_iter].label){
-        sstream << to_string(param_provided[params_iter].value);
-        param_match = true;
+  for(int i=0;i<method.body.size();i++){
+    Statement& stmt = method.body[i];
+    if(stmt.kind == STMT_CALL){
+      stmt.callee = findMethod(stmt.name);
+      if(stmt.callee < 0){
+        cerr << "line " << stmt.line << ": call to undefined method " << stmt.name << "\n";
+      } else if(stmt.args.size() < methods[stmt.callee].parameters.size()){
+        cerr << "line " << stmt.line << ": too few arguments in call to " << stmt.name << "\n";
+        stmt.callee = -1;
       }
     }
-    if(!param_match){
-      sstream << buffer.str();
+    Environment env = scope;
+    if(stmt.has_range){
+      stmt.range_iter = identifyRanges(stmt, env);
+    }
+    for(int j=0;j<stmt.args.size();j++){
+      stmt.arg_exps.push_back(bindMathExp(stmt.args[j], env));
+    }
+    if(stmt.kind != STMT_MU || !stmt.has_range){
+      for(int j=0;j<stmt.labels.size();j++){
+        stmt.label_exps.push_back(compileLabel(stmt.labels[j], env));
+      }
     }
-    buffer.str("");
-    buffer.clear();
+    stmt.spikes_exp = bindMathExp(stmt.spikes, env);
+    stmt.produced_exp = bindMathExp(stmt.produced, env);
+    stmt.delay_exp = bindMathExp(stmt.delay, env);
   }
-
-  return(sstream.str());
 }
 
-//Identify range of variables given
-void identifyRanges(string entry, TreeNode& root){
-  const int lesseq = 1, eqless = 2, less = 3;
-  vector<string> comma_split = split(entry, ",");
-  vector<Range> ranges;
-  vector<Range> exceptions;
-  for(int i=0;i<comma_split.size();i++){
-    Range range;
-    int delim1 = -1;
-    int delim1_mode = -1; 
-    //CASE <=
-    if(comma_split[i].find("<=")!=string::npos){
-      delim1 = comma_split[i].find("<=");
-      delim1_mode = lesseq;
-    }
-    //CASE =<
-    else if(comma_split[i].find("=<")!=string::npos){
-      delim1 = comma_split[i].find("=<");
-      delim1_mode = eqless;
-    }
-    //CASE <>
-    else if(comma_split[i].find("<>")){
-      delim1 = comma_split[i].find("<>");
-      range.x1 = trim(comma_split[i].substr(0, delim1));
-      range.x2 = trim(comma_split[i].substr(delim1+2, comma_split[i].length()));
-      exceptions.push_back(range);
-      continue;
-    }
-    //CASE <
-    else if(comma_split[i].find("<")!= string::npos){
-      delim1 = comma_split[i].find("<");
-      delim1_mode = less;
-    }
-    string substr = comma_split[i].substr(0, delim1);
-    range.x1 = trim(substr);
-    if(delim1_mode == less){
-      substr = comma_split[i].substr(delim1+1, comma_split[i].length());
-      range.inclusive_x1 = false;
-    }
-    else if(delim1_mode == lesseq || delim1_mode == eqless){
-      substr = comma_split[i].substr(delim1+2, comma_split[i].length());
-      range.inclusive_x1 = true;
-    }
+//Frame of a ranged statement: the method's values followed by a slot per
+//range variable
+Environment rangeFrame(const Statement& stmt, const Environment& frame){
+  Environment env;
+  env.values = frame.values;
+  env.values.resize(frame.values.size() + stmt.ranges.size(), 0);
+  return env;
+}
 
-    if(substr.find("<=")!=string::npos){
-      delim1 = substr.find("<=");
-      delim1_mode = lesseq;
+void eval_call(const Statement& stmt, const Environment& frame){
+  if(stmt.callee < 0){
+    return;
+  }
+  Environment callee_frame;
+  callee_frame.values.resize(stmt.arg_exps.size());
+  for(int i=0;i<stmt.arg_exps.size();i++){
+    callee_frame.values[i] = evalMathExp(stmt.arg_exps[i], frame);
+  }
+  //Only calls made by main itself are cached, deeper ones are part of their fragment
+  if(compile_cache.fragments && !compile_cache.recording){
+    runCachedCall(methods[stmt.callee], callee_frame);
+    return;
+  }
+  runMethod(methods[stmt.callee], callee_frame);
+}
 
-    }
-    else if(substr.find("=<")!=string::npos){
-      delim1 = substr.find("=<");
-      delim1_mode = eqless;
-    }
-    else if(substr.find("<")!= string::npos){
-      delim1 = substr.find("<");
-      delim1_mode = less;
-    }
+void eval_rule(const Statement& stmt, const Environment& frame){
+  if(stmt.has_range){
     
-    range.label = trim(substr.substr(0, delim1));
+    Environment env = rangeFrame(stmt, frame);
+    RangeIterator ranges = stmt.range_iter;
 
-    if(delim1_mode == less){
-      substr = substr.substr(delim1+1, substr.length());
-      range.inclusive_x2 = false;
-    }
-    else if(delim1_mode == lesseq || delim1_mode == eqless){
-      substr = substr.substr(delim1+2, substr.length());
-      range.inclusive_x2 = true;
+    if(families.enabled){
+      RuleFamily family;
+      family.position = snpsystem.rule_c.size();
+      family.ranges = ranges;
+      family.env = env;
+      family.neuron = stmt.label_exps[0];
+      family.regex = stmt.regex;
+      family.c = stmt.spikes_exp;
+      family.p = stmt.produced_exp;
+      family.d = stmt.delay_exp;
+      families.rules.push_back(family);
+      return;
     }
+    createRules(ranges, env, stmt.label_exps[0], stmt.regex, stmt.spikes_exp,
+                stmt.produced_exp, stmt.delay_exp);
 
-    range.x2 = trim(substr);
-    ranges.push_back(range);
+  } else {
+    Rule rule;
+    rule.neuron_label = internLabel(renderLabel(stmt.label_exps[0], frame));
+    rule.d = evalMathExp(stmt.delay_exp, frame);
+    rule.c = evalMathExp(stmt.spikes_exp, frame);
+    rule.p = evalMathExp(stmt.produced_exp, frame);
+    rule.regex = internRuleRegex(stmt.regex, rule.c);
+    addRule(rule);
   }
+}
 
-  stack<int> range_stack;
-  vector<Range> dummy;
-  for(int i=ranges.size()-1;i>=0;i--){
-    if(i==0){
-      recursiveBranching(root, ranges[i], exceptions);
+
+void createRules(RangeIterator& ranges, Environment& env, const LabelTemplate& neuron_, const string& regex_,
+                 const BoundExp& c_, const BoundExp& p_, const BoundExp& d_){
+  //Rules given no regex are grouped by neuron for set rules (--rule-sets)
+  bool grouped = snpsystem.rule_sets && regex_.empty();
+  RuleGroups groups;
+  vector<vector<string> > slice_labels(rangeSliceCount());
+  vector<vector<Rule> > slices(slice_labels.size());
+  function<void(int, RangeIterator&, Environment&)> expand = [&](int slice, RangeIterator& sliced, Environment& slice_env){
+    expandRules(sliced, slice_env, neuron_, c_, p_, d_, slice_labels[slice], slices[slice]);
+  };
+  function<void(int)> merge = [&](int slice){
+    if(grouped){
+      groupRules(groups, slice_labels[slice], slices[slice]);
     } else {
-      recursiveBranching(root, ranges[i], dummy);
+      addRuleLabels(slice_labels[slice], slices[slice], regex_);
+    }
+    slice_labels[slice].clear();
+    slices[slice].clear();
+  };
+  if(!expandInSlices(ranges, env, expand, merge)){
+    vector<string> labels;
+    vector<Rule> rules;
+    expandRules(ranges, env, neuron_, c_, p_, d_, labels, rules);
+    if(grouped){
+      groupRules(groups, labels, rules);
+    } else {
+      addRuleLabels(labels, rules, regex_);
     }
   }
+  addRuleGroups(groups);
 }
 
-//Recursive branching out of Range tree
-void recursiveBranching(TreeNode& node, Range range, vector<Range> exceptions){
-  if(node.children.empty()){
-    TreeNode new_node;
-    int x1;
-    int x2;
-    
-    TreeNode *curr = &node; 
-    vector<Parameter> params;
-    while(curr->label!="root"){
-      Parameter param;
-      param.label = curr->label;
-      param.value = curr->value;
-      params.push_back(param);
-      curr = curr->parent;
-    }
-
-    //Left hand side is a constant && Right hand side is a constant
-    if(is_number(range.x1) && is_number(range.x2)){
-      x1 = stoi(range.x1);
-      x2 = stoi(range.x2);
-    } 
-    //Left hand side is a constant && Right hand side is not
-    else if(is_number(range.x1) && !is_number(range.x2)){
-      x1 = stoi(range.x1);
-      string match = subsMathExp(match, params);
-      x2 = evalMathExp(match);
-    }
-    //Left hand side is not a constant && Right hand side is a constant
-    else if(!is_number(range.x1) && is_number(range.x2)){
-      x2 = stoi(range.x2);
-      string match = subsMathExp(match, params);
-      x1 = evalMathExp(match);
-    }
-    else{
-      string match_x1 = subsMathExp(match_x1, params);
-      string match_x2 = subsMathExp(match_x2, params);
-      x1 = evalMathExp(match_x1);
-      x2 = evalMathExp(match_x2);
-    }
-    if(!range.inclusive_x1) x1++;
-    if(range.inclusive_x2) x2++;
-    for(x1;x1<x2;x1++){
-      bool will_add = true;;
-      vector<Parameter> prms = params;
-      Parameter n_prm;
-      n_prm.label = range.label;
-      n_prm.value = x1;
-      prms.push_back(n_prm);
-      for(int i=0;i<exceptions.size();i++){
-        string ex_1 = subsMathExp(exceptions[i].x1, prms);
-        string ex_2 = subsMathExp(exceptions[i].x2, prms);
-        int ex_1val = evalMathExp(ex_1);
-        int ex_2val = evalMathExp(ex_2);
-        if(ex_1val == ex_2val) will_add = false;
-      }
-
-      if(will_add){
-        TreeNode new_node;
-        new_node.label = range.label;
-        new_node.value = x1;
-        new_node.parent = &node;
-        node.children.push_back(new_node);
-      }
-    }
-  }
-  else{
-    for(int i=0;i<node.children.size();i++){
-      recursiveBranching(node.children[i], range, exceptions);
-    }
+//Renders the neuron label and evaluates c, p and d of every rule in the
+//index space. Labels and regexes are interned when the slices are merged
+void expandRules(RangeIterator& ranges, Environment& env, const LabelTemplate& neuron_,
+                 const BoundExp& c_, const BoundExp& p_, const BoundExp& d_,
+                 vector<string>& labels, vector<Rule>& rules){
+  while(nextRange(ranges, env)){
+    Rule rule;
+    labels.push_back(renderLabel(neuron_, env));
+    rule.c = evalMathExp(c_, env);
+    rule.p = evalMathExp(p_, env);
+    rule.d = evalMathExp(d_, env);
+    rules.push_back(rule);
   }
 }
 
-//Splits string using whitespace as a delimiter
-vector<string> whitespace_split(string tosplit){
-  istringstream iss(tosplit);
-  vector<string> tokens;
-  copy(istream_iterator<string>(iss),
-      istream_iterator<string>(),
-      back_inserter(tokens));
-  return tokens;
+void addRuleLabels(const vector<string>& labels, vector<Rule>& rules, const string& regex_){
+  int regex = regex_.empty() ? -1 : internRuleRegex(regex_, 0);
+  for(int i=0;i<rules.size();i++){
+    rules[i].neuron_label = internLabel(labels[i]);
+    rules[i].regex = regex >= 0 ? regex : internRuleRegex(regex_, rules[i].c);
+    addRule(rules[i]);
+  }
 }
 
-//Splits string given a delimiter as a parameter
-vector<string> split(string tosplit, string delimiter){
-  int string_len = tosplit.length();
-  vector<string> retval;
-
-  int curr = 0;
-  int nextToken = 0;
-  while((nextToken = tosplit.find(delimiter)) != string::npos){
-    if(nextToken > 0){
-      retval.push_back(trim(tosplit.substr(0, nextToken)));
+//Merges a slice of a ranged rule statement's rules into their groups
+void groupRules(RuleGroups& groups, const vector<string>& labels, vector<Rule>& rules){
+  for(int i=0;i<rules.size();i++){
+    rules[i].neuron_label = internLabel(labels[i]);
+    vector<Rule>& group = groups.rules[rules[i].neuron_label];
+    if(group.empty()){
+      groups.order.push_back(rules[i].neuron_label);
     }
-    tosplit.erase(0, nextToken+1);
+    group.push_back(rules[i]);
   }
-  if(tosplit.length()>0){
-    retval.push_back(trim(tosplit));
-  }
-  return retval;
 }
 
-//Removes leading and trailing whitespaces
-string trim(string entry){
-  string whitespace = " \t";
-  if(entry.length()<=0){
-    return "";
+//Adds each group as one set rule when it can be, as its a<c> rules otherwise
+void addRuleGroups(RuleGroups& groups){
+  for(int i=0;i<groups.order.size();i++){
+    vector<Rule>& group = groups.rules[groups.order[i]];
+    SpikeSet set;
+    if(makeSpikeSet(group, set)){
+      Rule rule = group[0];
+      rule.c = CONSUME_ALL;
+      rule.regex = internString(snpsystem.regexes, spikeSetRegex(set));
+      addRule(rule);
+    } else {
+      for(int j=0;j<group.size();j++){
+        group[j].regex = internRuleRegex("", group[j].c);
+        addRule(group[j]);
+      }
+    }
+    vector<Rule>().swap(group);
   }
-  int beginn = entry.find_first_not_of(whitespace);
-  int end = entry.find_last_not_of(whitespace);
-  int range = end - beginn + 1;
-  return entry.substr(beginn, range);
 }
 
-//Simply get method label (main, init_snp, etc..)
-string getMethodName(string buffer){
-  if(buffer.find("def")!=string::npos&&buffer.find("call")!=string::npos){
-    return "";
+//The rules of a neuron can become one set rule if they differ only in the
+//spikes they consume: then no two of them apply to the same spike count, so
+//their order does not matter. Counts missing from the span are excluded, as
+//long as they do not outnumber the rules
+//returns false if the rules have to stay as they are
+bool makeSpikeSet(const vector<Rule>& rules, SpikeSet& set){
+  if(rules.size() < 2){
+    return false;
   }
-  vector<string> w_split = whitespace_split(buffer);
-  int sub_end = w_split[1].find("(");
-  return w_split[1].substr(0, sub_end);
-}
-
-//Get Method Parameters needed from def
-vector<Parameter> getDefParameters(string buffer){
-  vector<Parameter> new_param;
-  if(buffer.find("def")==string::npos){
-    return new_param;
-  }
-  vector<string> w_split = whitespace_split(buffer);
-  int params_start = w_split[1].find("(");
-  string substr = w_split[1].substr(params_start, w_split[1].length()-1);
-  substr.erase(remove(substr.begin(), substr.end(), '('), substr.end());
-  substr.erase(remove(substr.begin(), substr.end(), ')'), substr.end());
-  substr.erase(remove(substr.begin(), substr.end(), '{'), substr.end());
-  vector<string> splitparameters = split(substr, ",");
-  for(int i=0;i<splitparameters.size();i++){
-    Parameter param;
-    param.label = splitparameters[i];
-    param.value = -1;
-    new_param.push_back(param);
+  vector<long> counts;
+  for(int i=0;i<rules.size();i++){
+    if(rules[i].p != rules[0].p || rules[i].d != rules[0].d){
+      return false;
+    }
+    counts.push_back(rules[i].c);
+  }
+  sort(counts.begin(), counts.end());
+  if(counts[0] < 1 || adjacent_find(counts.begin(), counts.end()) != counts.end() ||
+     counts.back() - counts[0] + 1 - (long)counts.size() > (long)counts.size()){
+    return false;
+  }
+  set.low = counts[0];
+  set.high = counts.back();
+  set.excluded.clear();
+  for(int i=1;i<counts.size();i++){
+    for(long count=counts[i-1]+1;count<counts[i];count++){
+      set.excluded.push_back(count);
+    }
   }
-  return new_param;
+  return true;
 }
 
-//Get Method Parameters provided from call
-vector<Parameter> getCallParameters(string buffer){
-  vector<Parameter> new_param;
-  if(buffer.find("call")==string::npos){
-    return new_param;
+//returns false if the regex is not a spike set
+bool parseSpikeSet(string_view regex, SpikeSet& set){
+  if(regex.size() < 2 || regex.substr(0, 2) != "a["){
+    return false;
   }
-  vector<string> w_split = whitespace_split(buffer);
-  int params_start = w_split[1].find("(");
-  string substr = w_split[1].substr(params_start, w_split[1].length()-1);
-  substr.erase(remove(substr.begin(), substr.end(), '('), substr.end());
-  substr.erase(remove(substr.begin(), substr.end(), ')'), substr.end());
-  substr.erase(remove(substr.begin(), substr.end(), '{'), substr.end());
-  vector<string> splitparameters = split(substr, ",");
-  for(int i=0;i<splitparameters.size();i++){
-    Parameter param;
-    param.label = "";
-    param.value = stoi(splitparameters[i]);
-    new_param.push_back(param);
+  string text(regex.substr(2));
+  char *end = NULL;
+  set.low = strtol(text.c_str(), &end, 10);
+  if(*end != ','){
+    return false;
   }
-  return new_param;
-}
-//Given a line, check if it possibly contains a special keyword
-//returns the index of the keyword if there is, else return -1
-int checkLineSpecialKeyword(string query){
-  vector<string> split = whitespace_split(query);
-  for(int i=0;i<split.size();i++){
-    int check = checkSpecialKeyword(split[i]);
-    if(check>=0){
-      return check;
-    }
+  set.high = strtol(end+1, &end, 10);
+  if(*end != ']'){
+    return false;
   }
-  return -1;
+  set.excluded.clear();
+  end++;
+  if(*end == '!'){
+    do{
+      set.excluded.push_back(strtol(end+1, &end, 10));
+    }while(*end == ',');
+  }
+  return *end == '\0';
 }
 
-//Given a line, check if it possibly contains a reserve keyword
-//returns the index of the keyword if there is, else return -1
-int checkLineReserveKeyword(string query){
-  for(int i=0;i<RESERVE_KEYWORD_COUNT;i++){
-    int find = query.find(RESERVE_KEYWORDS[i]);
-    if(find!=string::npos){
-      return i;
-    }
+string spikeSetRegex(const SpikeSet& set){
+  string regex = "a[" + to_string(set.low) + "," + to_string(set.high) + "]";
+  for(int i=0;i<set.excluded.size();i++){
+    regex += (i == 0 ? "!" : ",") + to_string(set.excluded[i]);
   }
-  return -1;
+  return regex;
 }
 
-//Check if given word is in reserve keywords
-//Returns -1 if no match, else returns the index of keyword match
-int checkReserveKeyword(string query){
-  int retval=0;
-  for(int i=0;i<RESERVE_KEYWORD_COUNT;i++){
-    if(query == RESERVE_KEYWORDS[i]){
-      return i;
+void spikeSetCounts(const SpikeSet& set, vector<long>& counts){
+  counts.clear();
+  for(long count=set.low;count<=set.high;count++){
+    if(!binary_search(set.excluded.begin(), set.excluded.end(), count)){
+      counts.push_back(count);
     }
   }
-  return -1;
 }
 
-//Check if given word is in special keywords
-//Returns -1 if no match, else returns the index of keyword match
-int checkSpecialKeyword(string query){
-  int retval=0;
-  for(int i=0;i<SPECIAL_KEYWORD_COUNT;i++){
-    if(query == SPECIAL_KEYWORDS[i]){
-      return i;
-    }
+//Number of CuSNP rule lines a rule expands to
+long ruleLineCount(string_view regex, int c){
+  SpikeSet set;
+  if(c != CONSUME_ALL || !parseSpikeSet(regex, set)){
+    return 1;
   }
-  return retval;
+  vector<long> counts;
+  spikeSetCounts(set, counts);
+  return counts.size();
 }
 
-//Find a char sequence in a string from a given index up until the end of string
-int findFromIndex(string source, string tofind, int index){
-  string buffer = source.substr(index, source.length());
-  int find_val = buffer.find(tofind);
-  if(find_val == string::npos){
-    return -1;
+//Writes a rule's CuSNP line after its neuron ids. Set rules are expanded to
+//their a<k> rules unless the output keeps them (--rule-sets)
+void writeRuleLines(ostream& out, const string& ids, string_view regex, int c, int p, int d, bool rule_sets){
+  SpikeSet set;
+  if(rule_sets || c != CONSUME_ALL || !parseSpikeSet(regex, set)){
+    out << ids << regex << " " << c << " " << p << " " << d << '\n';
+    return;
   }
-  else{
-    return index + find_val;
+  vector<long> counts;
+  spikeSetCounts(set, counts);
+  for(int i=0;i<counts.size();i++){
+    out << ids << "a" << counts[i] << " " << counts[i] << " " << p << " " << d << '\n';
   }
 }
 
-//Check if given string is a number
-bool is_number(string s){
-  bool is_number = true;
-  for(int i=0;i<s.length();i++){
-    is_number = is_number && isdigit(s.at(i));
-  }
-  return is_number;
-  /**
-    string::const_iterator it = s.begin();
-    while (it != s.end() && isdigit(*it)) ++it;
-    return !s.empty() && it == s.end();
-  **/
-}
-//Print MethodHolder. simple. duh
-void printMethodHolder(MethodHolder method){
-  cout << method.label << endl;
-  for(int i=0;i<method.contents.size();i++){
-    cout << method.contents[i] << endl;
+//Returns the id of a rule's regex, a<c> when the rule was given none
+int internRuleRegex(const string& regex, int c){
+  if(!regex.empty()){
+    return internString(snpsystem.regexes, regex);
   }
+  return internString(snpsystem.regexes, "a" + to_string(c));
 }
 
-//Print Parameter. duh
-void printParameter(Parameter param){
-  cout << param.label << ":" << param.value << endl;
-}
+void eval_mu(const Statement& stmt, const Environment& frame){
+  //Case: Range is specified
+  if(stmt.has_range){
+    Environment env = rangeFrame(stmt, frame);
+    RangeIterator ranges = stmt.range_iter;
+
+    vector<string> new_labels;
+    createNeurons(ranges, env, stmt, new_labels);
+
+    //Evaluation for expression: += | =
+    if(!stmt.append){
+      clearNeurons();
+    }
+    for(int i=0;i<new_labels.size();i++){
+      addNeuron(internLabel(new_labels[i]));
+    }
 
-//Print SNP. duh
-void printSNP(){
-  cout << "Neurons:" << endl;
-  for(int i=0;i<snpsystem.neurons.size();i++){
-    cout << "\t" << snpsystem.neurons[i].label << "::" << snpsystem.neurons[i].spikes <<  endl;
   }
-  cout << "Synapses:" << endl;
-  for(int i=0;i<snpsystem.synapses.size();i++){
-    cout << "\t" << snpsystem.synapses[i].from << ">>" << snpsystem.synapses[i].to << endl;
+  //Case: No Range Specified
+  else{
+    if(!stmt.append){
+      clearNeurons();
+    }
+    for(int i=0;i<stmt.label_exps.size();i++){
+      addNeuron(internLabel(renderLabel(stmt.label_exps[i], frame)));
+    }
   }
-  cout << "Rules:" << endl;
-  for(int i=0;i<snpsystem.rules.size();i++){
-    cout << "\t" << snpsystem.rules[i].neuron_label << " : " << snpsystem.rules[i].regex << "|"
-        << "a*" << snpsystem.rules[i].c << "-->" << "a*" << snpsystem.rules[i].p << ":" 
-        << snpsystem.rules[i].d << endl;
+}
+
+//Renders a neuron label per range binding for every label{variable} of the
+//statement, innermost range variable first
+void createNeurons(RangeIterator& ranges, Environment& env, const Statement& stmt, vector<string>& labels){
+  while(nextRange(ranges, env)){
+    for(int level=ranges.levels.size()-1;level>=0;level--){
+      for(int i=0;i<stmt.labels.size();i++){
+        if(stmt.label_vars[i]==ranges.levels[level].label){
+          labels.push_back(stmt.labels[i] + "{" + to_string(env.values[ranges.slots[level]]) + "}");
+        }
+      }
+    }
   }
 }
 
-void outCuSnp(){
-  cout << snpsystem.neurons.size() << endl;
-  cout << snpsystem.rules.size() << endl;
-  cout << snpsystem.simulationsteps << endl;
-  for(int i=0;i<snpsystem.neurons.size();i++){
-  cout << snpsystem.neurons[i].spikes << " ";
-  snpsystem.neurons[i].id = i;
-  } cout << endl;
+void eval_ms(const Statement& stmt, const Environment& frame){
+  if(stmt.has_range){
+    Environment env = rangeFrame(stmt, frame);
+    RangeIterator ranges = stmt.range_iter;
 
-  for(int i=0;i<snpsystem.synapses.size();i++){
-    for(int j=0;j<snpsystem.neurons.size();j++){
-      if(snpsystem.synapses[i].from == snpsystem.neurons[j].label){
-        snpsystem.neurons[j].syns.push_back(snpsystem.synapses[i]); break;
-      }    
+    createSpikes(ranges, env, stmt.label_exps[0], !stmt.append, stmt.spikes_exp);
+  } else {
+    string neuron_label = renderLabel(stmt.label_exps[0], frame);
+    int mathexpresult = evalMathExp(stmt.spikes_exp, frame);
+    if(stmt.append){
+      addSpike(neuron_label, mathexpresult);
+    } else {
+      setSpike(neuron_label, mathexpresult);
     }
   }
 
-  for(int i=0;i<snpsystem.neurons.size();i++){
-    cout << snpsystem.neurons[i].syns.size() << " ";
-    for(int j=0;j<snpsystem.neurons[i].syns.size();j++){
-      for(int k=0;k<snpsystem.neurons.size();k++){
-        if(snpsystem.neurons[i].syns[j].to == snpsystem.neurons[k].label){
-          cout << snpsystem.neurons[k].id << " "; break;
-        }
-      }  
-    }cout << endl;
-  }
+}
 
-  for(int i=0;i<snpsystem.rules.size();i++){
-    for(int j=0;j<snpsystem.neurons.size();j++){
-      if(snpsystem.rules[i].neuron_label == snpsystem.neurons[j].label){
-        cout << snpsystem.neurons[j].id << " ";
-      }
+void createSpikes(RangeIterator& ranges, Environment& env, const LabelTemplate& neuron_,
+                  bool set_spike, const BoundExp& spikes_){
+  while(nextRange(ranges, env)){
+    string neuron_label = renderLabel(neuron_, env);
+    int mathexpresult = evalMathExp(spikes_, env);
+    if(set_spike){
+      setSpike(neuron_label, mathexpresult);
+    } else {
+      addSpike(neuron_label, mathexpresult);
     }
-    cout << snpsystem.rules[i].regex << " " << snpsystem.rules[i].c << " " << snpsystem.rules[i].p << " " << snpsystem.rules[i].d << endl;
   }
-
 }
 
-void printRange(Range r){
+//Returns the id of a string in the pool, copying it in on first use
+int internString(StringPool& pool, string_view str){
+  unordered_map<string_view, int>::const_iterator it = pool.ids.find(str);
+  if(it != pool.ids.end()){
+    return it->second;
+  }
+  if(pool.blocks.empty() || pool.block_used + str.size() > STRING_POOL_BLOCK){
+    pool.blocks.emplace_back(new char[max(STRING_POOL_BLOCK, str.size())]);
+    pool.block_used = 0;
+  }
+  char *copy = pool.blocks.back().get() + pool.block_used;
+  memcpy(copy, str.data(), str.size());
+  pool.block_used += str.size();
+  int id = pool.strings.size();
+  pool.strings.push_back(string_view(copy, str.size()));
+  pool.ids.emplace(pool.strings.back(), id);
+  return id;
+}
+
+//returns -1 if the string was never interned
+int findString(const StringPool& pool, string_view str){
+  unordered_map<string_view, int>::const_iterator it = pool.ids.find(str);
+  if(it == pool.ids.end()){
+    return -1;
+  }
+  return it->second;
+}
+
+//Returns the id of a label in the symbol table, adding it on first use
+int internLabel(string_view label){
+  int id = internString(snpsystem.labels, label);
+  if(id == snpsystem.label_neurons.size()){
+    snpsystem.label_neurons.push_back(-1);
+  }
+  return id;
+}
+
+//Appends a neuron to the system and registers its label in the symbol table
+//A repeated label keeps resolving to its first declaration, later ones are chained
+void addNeuron(int label){
+  int id = snpsystem.neuron_labels.size();
+  if(snpsystem.label_neurons[label] < 0){
+    snpsystem.label_neurons[label] = id;
+  } else {
+    int last = snpsystem.label_neurons[label];
+    while(snpsystem.next_same_label[last] >= 0){
+      last = snpsystem.next_same_label[last];
+    }
+    snpsystem.next_same_label[last] = id;
+  }
+  snpsystem.neuron_labels.push_back(label);
+  snpsystem.spikes.push_back(0);
+  snpsystem.next_same_label.push_back(-1);
+  if(compile_cache.recording){
+    recordOp({FRAG_NEURON, fragmentString(snpsystem.labels.strings[label])});
+  }
+  stats.neurons++;
+}
+
+//Removes every neuron (@mu = ...), labels stay interned for the synapses using them
+void clearNeurons(){
+  snpsystem.neuron_labels.clear();
+  snpsystem.spikes.clear();
+  snpsystem.next_same_label.clear();
+  snpsystem.label_neurons.assign(snpsystem.labels.strings.size(), -1);
+  if(compile_cache.recording){
+    recordOp({FRAG_CLEAR});
+  }
+}
+
+//Finds the id of a neuron given its label
+//returns -1 if neuron does not exist
+int findNeuron(const string& label){
+  int id = findString(snpsystem.labels, label);
+  if(id < 0){
+    return -1;
+  }
+  return snpsystem.label_neurons[id];
+}
+
+//Records a rule, spilling it to disk when output is streamed
+void addRule(const Rule& rule){
+  stats.rules++;
+  if(compile_cache.recording){
+    recordOp({FRAG_RULE, fragmentString(snpsystem.labels.strings[rule.neuron_label]),
+              fragmentString(snpsystem.regexes.strings[rule.regex]), rule.c, rule.p, rule.d});
+  }
+  if(spill.rules == NULL){
+    snpsystem.rule_labels.push_back(rule.neuron_label);
+    snpsystem.rule_regexes.push_back(rule.regex);
+    snpsystem.rule_c.push_back(rule.c);
+    snpsystem.rule_p.push_back(rule.p);
+    snpsystem.rule_d.push_back(rule.d);
+    return;
+  }
+  fwrite(&rule, sizeof(Rule), 1, spill.rules);
+  spill.rule_count++;
+  spill.rule_lines += rule.c == CONSUME_ALL ? ruleLineCount(snpsystem.regexes.strings[rule.regex], rule.c) : 1;
+}
+
+//Records a synapse, spilling it to disk when output is streamed
+void addSynapse(const Synapse& syn){
+  stats.synapses++;
+  if(compile_cache.recording){
+    recordOp({FRAG_SYNAPSE, fragmentString(snpsystem.labels.strings[syn.from]),
+              fragmentString(snpsystem.labels.strings[syn.to])});
+  }
+  if(spill.synapses == NULL){
+    snpsystem.synapse_from.push_back(syn.from);
+    snpsystem.synapse_to.push_back(syn.to);
+    return;
+  }
+  fwrite(&syn, sizeof(Synapse), 1, spill.synapses);
+  spill.synapse_count++;
+}
+
+void setSpike(const string& neuron_label, int spikes){
+  if(compile_cache.recording){
+    recordOp({FRAG_SET_SPIKE, fragmentString(neuron_label), spikes});
+  }
+  for(int id=findNeuron(neuron_label);id>=0;id=snpsystem.next_same_label[id]){
+    snpsystem.spikes[id] = spikes;
+  }
+}
+
+void addSpike(const string& neuron_label, int spikes){
+  if(compile_cache.recording){
+    recordOp({FRAG_ADD_SPIKE, fragmentString(neuron_label), spikes});
+  }
+  for(int id=findNeuron(neuron_label);id>=0;id=snpsystem.next_same_label[id]){
+    snpsystem.spikes[id] += spikes;
+  }
+}
+
+void eval_arcs(const Statement& stmt, const Environment& frame){
+  if(stmt.has_range){
+
+    Environment env = rangeFrame(stmt, frame);
+    RangeIterator ranges = stmt.range_iter;
+
+    if(families.enabled){
+      SynapseFamily family;
+      family.position = snpsystem.synapse_from.size();
+      family.ranges = ranges;
+      family.env = env;
+      family.entry = stmt.label_exps;
+      families.synapses.push_back(family);
+      return;
+    }
+    createSynapses(ranges, env, stmt.label_exps);
+  } else {
+    addSynapses(stmt.label_exps, frame);
+  }
+}
+
+void createSynapses(RangeIterator& ranges, Environment& env, const vector<LabelTemplate>& entry){
+  vector<vector<string> > slices(rangeSliceCount());
+  function<void(int, RangeIterator&, Environment&)> expand = [&](int slice, RangeIterator& sliced, Environment& slice_env){
+    expandSynapses(sliced, slice_env, entry, slices[slice]);
+  };
+  function<void(int)> merge = [&](int slice){
+    addSynapseLabels(slices[slice]);
+    slices[slice].clear();
+  };
+  if(!expandInSlices(ranges, env, expand, merge)){
+    vector<string> labels;
+    expandSynapses(ranges, env, entry, labels);
+    addSynapseLabels(labels);
+  }
+}
+
+//Renders the (from, to) labels of every synapse in the index space
+//Labels are interned when the slices are merged so ids follow declaration order
+void expandSynapses(RangeIterator& ranges, Environment& env, const vector<LabelTemplate>& entry,
+                    vector<string>& labels){
+  while(nextRange(ranges, env)){
+    for(int i=0;i+1<entry.size();i+=2){
+      labels.push_back(renderLabel(entry[i], env));
+      labels.push_back(renderLabel(entry[i+1], env));
+    }
+  }
+}
+
+void addSynapseLabels(const vector<string>& labels){
+  for(int i=0;i+1<labels.size();i+=2){
+    Synapse syn;
+    syn.from = internLabel(labels[i]);
+    syn.to = internLabel(labels[i+1]);
+    addSynapse(syn);
+  }
+}
+
+void addSynapses(const vector<LabelTemplate>& entry, const Environment& env){
+  for(int i=0;i+1<entry.size();i+=2){
+    Synapse syn;
+    syn.from = internLabel(renderLabel(entry[i], env));
+    syn.to = internLabel(renderLabel(entry[i+1], env));
+    addSynapse(syn);
+  }
+}
+
+//Finds the index of the method in MethodHolder list given a string query
+//returns -1 if method does not exist
+int findMethod(const string& query){
+  unordered_map<string, int>::const_iterator it = method_ids.find(query);
+  if(it == method_ids.end()){
+    return -1;
+  }
+  return it->second;
+}
+
+//Compiles an arithmetic expression into a postfix program, reusing the cached
+//program when the same source text was compiled before
+const MathExp& compileMathExp(const string& mathexp){
+  unordered_map<string, MathExp>::iterator cached = mathexp_cache.find(mathexp);
+  if(cached != mathexp_cache.end()){
+    return cached->second;
+  }
+  MathExp& exp = mathexp_cache[mathexp];
+  stack<char> opstack;
+
+  if(trim(mathexp).empty() || trim(mathexp) == "#"){
+    return exp;
+  }
+  for(int i=0;i<mathexp.length();i++){
+    char currchar = mathexp.at(i);
+    if(currchar=='+'){
+      while(!opstack.empty() && (opstack.top() == '+' || opstack.top() == '-' || opstack.top() =='/' ||
+           opstack.top() =='*' || opstack.top()=='^')){
+        emitOperator(exp, opstack.top());
+        opstack.pop();
+      }
+      opstack.push('+');
+    } else if(currchar=='-'){
+      while(!opstack.empty() && (opstack.top() == '-' || opstack.top() =='/' ||
+           opstack.top() =='*' || opstack.top() =='^')){
+        emitOperator(exp, opstack.top());
+        opstack.pop();
+      }
+      opstack.push('-');
+    } else if(currchar=='/'){
+      while(!opstack.empty() && (opstack.top() == '/' || opstack.top() == '*' || opstack.top() == '^')){
+        emitOperator(exp, opstack.top());
+        opstack.pop();
+      }
+      opstack.push('/');
+    } else if(currchar=='*'){
+      while(!opstack.empty() && (opstack.top() == '*' || opstack.top() == '^')){
+        emitOperator(exp, opstack.top());
+        opstack.pop();
+      }
+      opstack.push('*');
+    } else if(currchar=='^'){
+      while(!opstack.empty() && (opstack.top() == '^')){
+        emitOperator(exp, opstack.top());
+        opstack.pop();
+      }
+      opstack.push('^');
+    } else if(currchar=='('){
+      opstack.push('(');
+    } else if(currchar==')'){
+      while(!opstack.empty() && opstack.top()!='('){
+        emitOperator(exp, opstack.top());
+        opstack.pop();
+      }
+      if(!opstack.empty()) opstack.pop();
+    } else if(currchar==' '){
+      //donothing
+    } else {
+      int start = i;
+      while( (i+1) < mathexp.length() && mathexp.at(i+1) != '+' && mathexp.at(i+1) != '-' &&
+            mathexp.at(i+1) != '*' && mathexp.at(i+1) != '/' &&
+            mathexp.at(i+1) != '^' && mathexp.at(i+1) != '(' &&
+            mathexp.at(i+1) != ')' && mathexp.at(i+1) != ' '){
+        i++;
+      }
+      emitOperand(exp, mathexp.substr(start, i-start+1));
+    }
+  }
+
+  while(!opstack.empty()){
+    emitOperator(exp, opstack.top());
+    opstack.pop();
+  }
+
+  //Size the evaluation stack once so evaluation never allocates
+  int height = 0;
+  for(int i=0;i<exp.code.size();i++){
+    if(exp.code[i] == EXP_CONST || exp.code[i] == EXP_VAR){
+      height++; i++;
+    } else if(height > 1){
+      height--;
+    } else {
+      height = 1;
+    }
+    exp.depth = max(exp.depth, height);
+  }
+  return exp;
+}
+
+void emitOperator(MathExp& exp, char op){
+  switch(op){
+    case '+': exp.code.push_back(EXP_ADD); break;
+    case '-': exp.code.push_back(EXP_SUB); break;
+    case '*': exp.code.push_back(EXP_MUL); break;
+    case '/': exp.code.push_back(EXP_DIV); break;
+    case '^': exp.code.push_back(EXP_POW); break;
+  }
+}
+
+//Numeric operands become constants, anything else is a variable slot
+void emitOperand(MathExp& exp, const string& operand){
+  if(isdigit(operand.at(0))){
+    exp.code.push_back(EXP_CONST);
+    exp.code.push_back(stoi(operand));
+    return;
+  }
+  int slot = find(exp.variables.begin(), exp.variables.end(), operand) - exp.variables.begin();
+  if(slot == exp.variables.size()){
+    exp.variables.push_back(operand);
+  }
+  exp.code.push_back(EXP_VAR);
+  exp.code.push_back(slot);
+}
+
+//Runs a compiled expression given one value per variable slot
+int evalMathExp(const MathExp& exp, const int *values){
+  if(stats.enabled){
+    stats.mathexp_evals.fetch_add(1, memory_order_relaxed);
+  }
+  if(exp.code.empty()){
+    return 0;
+  }
+  int small_stack[32];
+  vector<int> large_stack;
+  int *evalstack = small_stack;
+  if(exp.depth > 32){
+    large_stack.resize(exp.depth);
+    evalstack = &large_stack[0];
+  }
+  int top = 0;
+  for(int i=0;i<exp.code.size();i++){
+    int op = exp.code[i];
+    if(op == EXP_CONST){
+      evalstack[top++] = exp.code[++i];
+    } else if(op == EXP_VAR){
+      evalstack[top++] = values[exp.code[++i]];
+    } else {
+      int op_a = top > 0 ? evalstack[--top] : 0;
+      int op_b = top > 0 ? evalstack[--top] : 0;
+      switch(op){
+        case EXP_ADD: evalstack[top++] = op_b+op_a; break;
+        case EXP_SUB: evalstack[top++] = op_b-op_a; break;
+        case EXP_MUL: evalstack[top++] = op_b*op_a; break;
+        case EXP_DIV: evalstack[top++] = op_b/op_a; break;
+        case EXP_POW: evalstack[top++] = pow(op_b, op_a); break;
+      }
+    }
+  }
+  return evalstack[top-1];
+}
+
+//Finds the innermost binding of a variable
+//returns -1 if the variable is not bound
+int findBinding(const Environment& env, const string& label){
+  for(int i=env.labels.size()-1;i>=0;i--){
+    if(env.labels[i] == label){
+      return i;
+    }
+  }
+  return -1;
+}
+
+//Compiles an expression and resolves its variables against the environment layout
+BoundExp bindMathExp(const string& mathexp, const Environment& scope){
+  BoundExp bound;
+  bound.exp = &compileMathExp(mathexp);
+  for(int i=0;i<bound.exp->variables.size();i++){
+    bound.slots.push_back(findBinding(scope, bound.exp->variables[i]));
+  }
+  return bound;
+}
+
+int evalMathExp(const BoundExp& bound, const Environment& env){
+  int small_values[8];
+  vector<int> large_values;
+  int *values = small_values;
+  if(bound.slots.size() > 8){
+    large_values.resize(bound.slots.size());
+    values = &large_values[0];
+  }
+  for(int i=0;i<bound.slots.size();i++){
+    if(bound.slots[i] < 0){
+      throw invalid_argument("evalMathExp: unbound variable " + bound.exp->variables[i]);
+    }
+    values[i] = env.values[bound.slots[i]];
+  }
+  return evalMathExp(*bound.exp, values);
+}
+
+//Splits a neuron label into literal text and the variables used inside its braces
+//so it can be rendered for every binding without rescanning the label
+LabelTemplate compileLabel(const string& label, const Environment& scope){
+  LabelTemplate tmpl;
+  string text;
+  int depth = 0;
+  for(int i=0;i<label.length();i++){
+    char currchar = label.at(i);
+    if(currchar == '{'){
+      depth++;
+      text += currchar;
+    } else if(currchar == '}' || currchar == '+' || currchar == '-' || currchar == '*' ||
+              currchar == '/' || currchar == '<' || currchar == '>' || currchar == '=' ||
+              currchar == ' ' || currchar == ','){
+      if(currchar == '}' && depth > 0) depth--;
+      text += currchar;
+    } else if(depth == 0){
+      text += currchar;
+    } else {
+      int start = i;
+      while(i+1 < label.length() && string("{}+-*/<>=, ").find(label.at(i+1)) == string::npos){
+        i++;
+      }
+      string token = label.substr(start, i-start+1);
+      int slot = findBinding(scope, token);
+      if(slot < 0){
+        text += token;
+      } else {
+        tmpl.text.push_back(text);
+        tmpl.slots.push_back(slot);
+        text.clear();
+      }
+    }
+  }
+  tmpl.text.push_back(text);
+  return tmpl;
+}
+
+string renderLabel(const LabelTemplate& label, const Environment& env){
+  if(stats.enabled){
+    stats.label_renders.fetch_add(1, memory_order_relaxed);
+  }
+  if(label.slots.empty()){
+    return label.text[0];
+  }
+  string rendered;
+  for(int i=0;i<label.slots.size();i++){
+    rendered += label.text[i];
+    rendered += to_string(env.values[label.slots[i]]);
+  }
+  rendered += label.text.back();
+  return rendered;
+}
+
+//Binds the ranges of a statement: range variables are added to the environment
+//after the method parameters so bounds and exceptions can refer to any of them
+RangeIterator identifyRanges(const Statement& stmt, Environment& env){
+  vector<Range> ranges = stmt.ranges;
+  vector<Range> exceptions = stmt.exceptions;
+  for(int i=0;i<ranges.size();i++){
+    env.labels.push_back(ranges[i].label);
+    env.values.push_back(0);
+  }
+  for(int i=0;i<ranges.size();i++){
+    ranges[i].x1_exp = bindMathExp(ranges[i].x1, env);
+    ranges[i].x2_exp = bindMathExp(ranges[i].x2, env);
+  }
+  for(int i=0;i<exceptions.size();i++){
+    exceptions[i].x1_exp = bindMathExp(exceptions[i].x1, env);
+    exceptions[i].x2_exp = bindMathExp(exceptions[i].x2, env);
+  }
+
+  //The last range listed is the outermost loop
+  RangeIterator iter;
+  for(int i=ranges.size()-1;i>=0;i--){
+    iter.levels.push_back(ranges[i]);
+    iter.slots.push_back(findBinding(env, ranges[i].label));
+    iter.limits.push_back(0);
+  }
+  int depth = iter.levels.size();
+  iter.solved.resize(depth);
+  iter.checks.resize(depth);
+  iter.excluded.resize(depth);
+  iter.exceptions = exceptions;
+  if(depth == 0){
+    return iter;
+  }
+
+  //Level each exception is decided at: the deepest one it refers to, the
+  //outermost if it only uses parameters. An unbound variable has to fail
+  //at the first leaf as it always did, so then all of them wait for the leaf
+  vector<int> decided(exceptions.size(), 0);
+  bool unbound = false;
+  for(int i=0;i<exceptions.size();i++){
+    const BoundExp *sides[2] = {&exceptions[i].x1_exp, &exceptions[i].x2_exp};
+    for(int s=0;s<2;s++){
+      for(int j=0;j<sides[s]->slots.size();j++){
+        int slot = sides[s]->slots[j];
+        unbound = unbound || slot < 0;
+        for(int level=decided[i];level<depth;level++){
+          if(iter.slots[level] == slot) decided[i] = level;
+        }
+      }
+    }
+  }
+  for(int i=0;i<exceptions.size();i++){
+    int level = unbound ? depth-1 : decided[i];
+    int slot = iter.slots[level];
+    vector<int> level_slot(1, slot);
+    if(!unbound && affineIn(exceptions[i].x1_exp, level_slot) && affineIn(exceptions[i].x2_exp, level_slot)){
+      iter.solved[level].push_back(i);
+    } else {
+      iter.checks[level].push_back(i);
+    }
+  }
+  return iter;
+}
+
+//Whether an expression is affine in the variables at the given environment
+//indices, the others held fixed: no product of two terms using them and no
+//division or power involving them
+bool affineIn(const BoundExp& bound, const vector<int>& slots){
+  const vector<int>& code = bound.exp->code;
+  vector<int> degrees;
+  for(int i=0;i<code.size();i++){
+    int op = code[i];
+    if(op == EXP_CONST){
+      degrees.push_back(0);
+      i++;
+    } else if(op == EXP_VAR){
+      int slot = bound.slots[code[++i]];
+      degrees.push_back(find(slots.begin(), slots.end(), slot) != slots.end() ? 1 : 0);
+    } else {
+      int a = 0, b = 0;
+      if(!degrees.empty()){ a = degrees.back(); degrees.pop_back(); }
+      if(!degrees.empty()){ b = degrees.back(); degrees.pop_back(); }
+      if(op == EXP_ADD || op == EXP_SUB){
+        degrees.push_back(max(a, b));
+      } else if(op == EXP_MUL){
+        degrees.push_back(min(a+b, 2));
+      } else {
+        degrees.push_back(a+b > 0 ? 2 : 0);
+      }
+    }
+  }
+  return degrees.empty() || degrees.back() <= 1;
+}
+
+//Evaluates the bounds of a level against the enclosing levels' values and
+//positions it just before its first value
+void openRange(RangeIterator& ranges, Environment& env, int level){
+  const Range& range = ranges.levels[level];
+  int x1 = evalMathExp(range.x1_exp, env);
+  int x2 = evalMathExp(range.x2_exp, env);
+  if(!range.inclusive_x1) x1++;
+  if(range.inclusive_x2) x2++;
+  env.values[ranges.slots[level]] = x1-1;
+  ranges.limits[level] = x2;
+  excludeValues(ranges, env, level);
+}
+
+//Solves the affine exceptions of a level, positioned before its first value,
+//for the single value of its variable each one rules out. x1 - x2 is taken
+//at 0 and 1 to get its slope; one that holds for every value empties the level
+void excludeValues(RangeIterator& ranges, Environment& env, int level){
+  vector<int>& excluded = ranges.excluded[level];
+  excluded.clear();
+  int& value = env.values[ranges.slots[level]];
+  int start = value;
+  if(ranges.solved[level].empty() || start+1 >= ranges.limits[level]){
+    return;
+  }
+  for(int i=0;i<ranges.solved[level].size();i++){
+    const Range& exception = ranges.exceptions[ranges.solved[level][i]];
+    value = 0;
+    int at_0 = evalMathExp(exception.x1_exp, env) - evalMathExp(exception.x2_exp, env);
+    value = 1;
+    int slope = evalMathExp(exception.x1_exp, env) - evalMathExp(exception.x2_exp, env) - at_0;
+    if(slope == 0 && at_0 == 0){
+      ranges.limits[level] = start+1;
+      break;
+    } else if(slope != 0 && at_0 % slope == 0){
+      excluded.push_back(-at_0/slope);
+    }
+  }
+  value = start;
+}
+
+//Checks the exceptions decided at a level once its variable is bound
+bool rangeAdmits(const RangeIterator& ranges, const Environment& env, int level){
+  int value = env.values[ranges.slots[level]];
+  const vector<int>& excluded = ranges.excluded[level];
+  for(int i=0;i<excluded.size();i++){
+    if(value == excluded[i]) return false;
+  }
+  bool admitted = true;
+  const vector<int>& checks = ranges.checks[level];
+  for(int i=0;i<checks.size();i++){
+    const Range& exception = ranges.exceptions[checks[i]];
+    if(evalMathExp(exception.x1_exp, env) == evalMathExp(exception.x2_exp, env)) admitted = false;
+  }
+  return admitted;
+}
+
+//Binds the next combination of range values that passes every exception
+//returns false once the index space is exhausted
+bool nextRange(RangeIterator& ranges, Environment& env){
+  int depth = ranges.levels.size();
+  int level = depth-1;
+  if(!ranges.started){
+    ranges.started = true;
+    if(depth == 0){
+      if(stats.enabled){
+        stats.range_leaves.fetch_add(1, memory_order_relaxed);
+      }
+      return true;
+    }
+    level = 0;
+    openRange(ranges, env, 0);
+  }
+  while(level >= 0){
+    int& value = env.values[ranges.slots[level]];
+    value++;
+    if(value >= ranges.limits[level]){
+      level--;
+    } else if(!rangeAdmits(ranges, env, level)){
+      continue;
+    } else if(level < depth-1){
+      level++;
+      openRange(ranges, env, level);
+    } else {
+      if(stats.enabled){
+        stats.range_leaves.fetch_add(1, memory_order_relaxed);
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+//Positions the odometer on outermost values [begin, end) as though the deeper
+//levels had just run out, so the next call opens them for begin
+void sliceRange(RangeIterator& ranges, Environment& env, int begin, int end){
+  ranges.started = true;
+  env.values[ranges.slots[0]] = begin-1;
+  ranges.limits[0] = end;
+  excludeValues(ranges, env, 0);
+  for(int i=1;i<ranges.levels.size();i++){
+    env.values[ranges.slots[i]] = 0;
+    ranges.limits[i] = 0;
+  }
+}
+
+int rangeSliceCount(){
+  return (thread_pool.workers.size()+1)*RANGE_SLICES_PER_THREAD;
+}
+
+//Splits the outermost range into slices expanded by the thread pool, each from
+//its own copy of the iterator and environment. merge is called on the slices
+//in order so the result matches a serial walk. When output is streamed every
+//slice covers a single outer value to bound the buffered records
+//returns false, leaving the iterator untouched, if there is nothing to split
+bool expandInSlices(RangeIterator& ranges, Environment& env,
+                    const function<void(int, RangeIterator&, Environment&)>& expand,
+                    const function<void(int)>& merge){
+  if(thread_pool.workers.empty() || ranges.levels.empty() || ranges.started){
+    return false;
+  }
+  Environment outer_env = env;
+  openRange(ranges, outer_env, 0);
+  int first = outer_env.values[ranges.slots[0]]+1;
+  int limit = ranges.limits[0];
+  if(limit - first < 2){
+    return false;
+  }
+  int slice_count = rangeSliceCount();
+  int per_slice = 1;
+  if(spill.rules == NULL){
+    per_slice = (limit - first + slice_count - 1)/slice_count;
+  }
+  vector<exception_ptr> errors(slice_count);
+  for(long round=first;round<limit;round+=(long)per_slice*slice_count){
+    function<void(long, long)> job = [&](long begin, long end){
+      for(long slice=begin;slice<end;slice++){
+        long lo = round + slice*per_slice;
+        long hi = min(lo+per_slice, (long)limit);
+        if(lo >= hi){
+          continue;
+        }
+        RangeIterator sliced = ranges;
+        Environment slice_env = env;
+        sliceRange(sliced, slice_env, lo, hi);
+        try{
+          expand(slice, sliced, slice_env);
+        } catch(...){
+          errors[slice] = current_exception();
+        }
+      }
+    };
+    dispatchJob(slice_count, 1, job);
+    for(int slice=0;slice<slice_count;slice++){
+      if(errors[slice]){
+        rethrow_exception(errors[slice]);
+      }
+      merge(slice);
+    }
+  }
+  ranges.started = true;
+  return true;
+}
+
+//Splits string using whitespace as a delimiter
+vector<string> whitespace_split(string tosplit){
+  istringstream iss(tosplit);
+  vector<string> tokens;
+  copy(istream_iterator<string>(iss),
+      istream_iterator<string>(),
+      back_inserter(tokens));
+  return tokens;
+}
+
+//Splits string given a delimiter as a parameter
+//Empty pieces are skipped, the others are trimmed
+vector<string> split(string_view tosplit, string_view delimiter){
+  vector<string> retval;
+  size_t start = 0;
+  size_t nextToken;
+  while((nextToken = tosplit.find(delimiter, start)) != string::npos){
+    if(nextToken > start){
+      retval.push_back(trim(tosplit.substr(start, nextToken-start)));
+    }
+    start = nextToken+delimiter.length();
+  }
+  if(start < tosplit.length()){
+    retval.push_back(trim(tosplit.substr(start)));
+  }
+  return retval;
+}
+
+//Removes leading and trailing whitespaces
+string trim(string_view entry){
+  return string(trimView(entry));
+}
+
+string_view trimView(string_view entry){
+  size_t beginn = entry.find_first_not_of(" \t");
+  if(beginn == string::npos){
+    return string_view();
+  }
+  size_t end = entry.find_last_not_of(" \t");
+  return entry.substr(beginn, end - beginn + 1);
+}
+
+//Maps a source file read-only, an empty file maps to an empty view
+//returns false if the file cannot be opened
+bool mapSource(const char *filename, SourceFile& source){
+  int fd = open(filename, O_RDONLY);
+  if(fd < 0){
+    return false;
+  }
+  struct stat info;
+  if(fstat(fd, &info) != 0){
+    close(fd);
+    return false;
+  }
+  source.size = info.st_size;
+  source.data = "";
+  if(source.size > 0){
+    void *data = mmap(NULL, source.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED){
+      close(fd);
+      return false;
+    }
+    madvise(data, source.size, MADV_SEQUENTIAL);
+    source.data = (const char*)data;
+  }
+  close(fd);
+  return true;
+}
+
+void unmapSource(SourceFile& source){
+  if(source.size > 0){
+    munmap((void*)source.data, source.size);
+  }
+  source.data = NULL;
+  source.size = 0;
+}
+
+//Check if given word is in reserve keywords
+//Returns -1 if no match, else returns the index of keyword match
+int checkReserveKeyword(string_view query){
+  for(int i=0;i<RESERVE_KEYWORD_COUNT;i++){
+    if(query == RESERVE_KEYWORDS[i]){
+      return i;
+    }
+  }
+  return -1;
+}
+
+//Check if given word is in special keywords
+//Returns -1 if no match, else returns the index of keyword match
+int checkSpecialKeyword(string_view query){
+  for(int i=0;i<SPECIAL_KEYWORD_COUNT;i++){
+    if(query == SPECIAL_KEYWORDS[i]){
+      return i;
+    }
+  }
+  return -1;
+}
+
+//Find a char sequence in a string from a given index up until the end of string
+int findFromIndex(string source, string tofind, int index){
+  string buffer = source.substr(index, source.length());
+  int find_val = buffer.find(tofind);
+  if(find_val == string::npos){
+    return -1;
+  }
+  else{
+    return index + find_val;
+  }
+}
+
+//Check if given string is a number
+//Reads a whole token as a signed decimal integer
+//returns false if it is empty, has other characters or overflows
+bool parseInteger(const string& token, long& value){
+  if(token.empty()){
+    return false;
+  }
+  char *end;
+  errno = 0;
+  value = strtol(token.c_str(), &end, 10);
+  return *end == '\0' && errno == 0;
+}
+
+//parseInteger for a value that has to fit an int
+bool parseInt(const string& token, int& value){
+  long parsed;
+  if(!parseInteger(token, parsed) || parsed != (int)parsed){
+    return false;
+  }
+  value = parsed;
+  return true;
+}
+
+bool is_number(string s){
+  bool is_number = true;
+  for(int i=0;i<s.length();i++){
+    is_number = is_number && isdigit(s.at(i));
+  }
+  return is_number;
+  /**
+    string::const_iterator it = s.begin();
+    while (it != s.end() && isdigit(*it)) ++it;
+    return !s.empty() && it == s.end();
+  **/
+}
+//Print MethodHolder. simple. duh
+void printMethodHolder(MethodHolder method){
+  cout << method.label << endl;
+  for(int i=0;i<method.body.size();i++){
+    cout << "line " << method.body[i].line << ": statement kind " << method.body[i].kind << endl;
+  }
+}
+
+//Print Parameter. duh
+void printParameter(Parameter param){
+  cout << param.label << ":" << param.value << endl;
+}
+
+//Print SNP. duh
+void printSNP(){
+  cout << "Neurons:" << endl;
+  for(int i=0;i<snpsystem.neuron_labels.size();i++){
+    cout << "\t" << snpsystem.labels.strings[snpsystem.neuron_labels[i]] << "::" << snpsystem.spikes[i] <<  endl;
+  }
+  cout << "Synapses:" << endl;
+  for(int i=0;i<snpsystem.synapse_from.size();i++){
+    cout << "\t" << snpsystem.labels.strings[snpsystem.synapse_from[i]] << ">>"
+         << snpsystem.labels.strings[snpsystem.synapse_to[i]] << endl;
+  }
+  cout << "Rules:" << endl;
+  for(int i=0;i<snpsystem.rule_labels.size();i++){
+    cout << "\t" << snpsystem.labels.strings[snpsystem.rule_labels[i]] << " : "
+        << snpsystem.regexes.strings[snpsystem.rule_regexes[i]] << "|"
+        << "a*" << snpsystem.rule_c[i] << "-->" << "a*" << snpsystem.rule_p[i] << ":" 
+        << snpsystem.rule_d[i] << endl;
+  }
+}
+
+//Resolves the synapses to neuron ids and groups them by source neuron with
+//a counting sort. Synapses from undeclared neurons are dropped
+Adjacency buildAdjacency(){
+  Adjacency adjacency;
+  int neuron_count = snpsystem.neuron_labels.size();
+  const vector<int>& label_neurons = snpsystem.label_neurons;
+  const vector<int>& synapse_from = snpsystem.synapse_from;
+  adjacency.offsets.assign(neuron_count+1, 0);
+  for(long i=0;i<synapse_from.size();i++){
+    int from = label_neurons[synapse_from[i]];
+    if(from >= 0){
+      adjacency.offsets[from+1]++;
+    }
+  }
+  for(int i=0;i<neuron_count;i++){
+    adjacency.offsets[i+1] += adjacency.offsets[i];
+  }
+  vector<long> fill(adjacency.offsets.begin(), adjacency.offsets.end()-1);
+  adjacency.targets.resize(adjacency.offsets[neuron_count]);
+  for(long i=0;i<synapse_from.size();i++){
+    int from = label_neurons[synapse_from[i]];
+    if(from >= 0){
+      adjacency.targets[fill[from]++] = label_neurons[snpsystem.synapse_to[i]];
+    }
+  }
+  return adjacency;
+}
+
+void outCuSnp(bool rule_sets){
+  int neuron_count = snpsystem.neuron_labels.size();
+  long rule_lines = snpsystem.rule_c.size();
+  for(int i=0;i<snpsystem.rule_c.size() && !rule_sets;i++){
+    if(snpsystem.rule_c[i] == CONSUME_ALL){
+      rule_lines += ruleLineCount(snpsystem.regexes.strings[snpsystem.rule_regexes[i]], CONSUME_ALL) - 1;
+    }
+  }
+  cout << neuron_count << endl;
+  cout << rule_lines << endl;
+  cout << snpsystem.simulationsteps << endl;
+  for(int i=0;i<neuron_count;i++){
+  cout << snpsystem.spikes[i] << " ";
+  } cout << endl;
+
+  Adjacency adjacency = buildAdjacency();
+  for(int i=0;i<neuron_count;i++){
+    cout << adjacency.offsets[i+1] - adjacency.offsets[i] << " ";
+    for(long j=adjacency.offsets[i];j<adjacency.offsets[i+1];j++){
+      if(adjacency.targets[j] >= 0){
+        cout << adjacency.targets[j] << " ";
+      }
+    }cout << endl;
+  }
+
+  for(int i=0;i<snpsystem.rule_labels.size();i++){
+    string ids;
+    for(int id=snpsystem.label_neurons[snpsystem.rule_labels[i]];id>=0;id=snpsystem.next_same_label[id]){
+      ids += to_string(id) + " ";
+    }
+    writeRuleLines(cout, ids, snpsystem.regexes.strings[snpsystem.rule_regexes[i]], snpsystem.rule_c[i],
+                   snpsystem.rule_p[i], snpsystem.rule_d[i], rule_sets);
+  }
+  cout.flush();
+
+}
+
+//Switches output to streaming mode: rules and synapses go to temporary
+//files as they are created instead of being kept in snpsystem
+void openSpill(){
+  spill.rules = tmpfile();
+  spill.synapses = tmpfile();
+  if(spill.rules == NULL || spill.synapses == NULL){
+    //cout << "Cannot create temporary files, output will not be streamed" << endl;
+    spill.rules = NULL;
+    spill.synapses = NULL;
+  }
+}
+
+//Sorts a run of resolved (from, to) synapses by source neuron, keeping
+//creation order within a source, and writes it to a temporary file
+FILE* writeSynapseRun(vector<pair<int, int> >& run){
+  stable_sort(run.begin(), run.end(),
+              [](const pair<int, int>& a, const pair<int, int>& b){ return a.first < b.first; });
+  FILE *file = tmpfile();
+  fwrite(&run[0], sizeof(pair<int, int>), run.size(), file);
+  rewind(file);
+  run.clear();
+  return file;
+}
+
+//Produces the same text as outCuSnp from the spilled rules and synapses.
+//Synapses are resolved and sorted in bounded runs that are then merged by
+//source neuron, so only the neurons have to stay in memory
+void outStreamCuSnp(bool rule_sets){
+  int neuron_count = snpsystem.neuron_labels.size();
+  cout << neuron_count << '\n';
+  cout << (rule_sets ? spill.rule_count : spill.rule_lines) << '\n';
+  cout << snpsystem.simulationsteps << '\n';
+  for(int i=0;i<neuron_count;i++){
+    cout << snpsystem.spikes[i] << " ";
+  }
+  cout << '\n';
+
+  vector<long> degree(neuron_count, 0);
+  vector<FILE*> runs;
+  vector<pair<int, int> > run;
+  Synapse syn;
+  rewind(spill.synapses);
+  while(fread(&syn, sizeof(Synapse), 1, spill.synapses) == 1){
+    int from = snpsystem.label_neurons[syn.from];
+    if(from < 0){
+      continue;
+    }
+    run.push_back(make_pair(from, snpsystem.label_neurons[syn.to]));
+    degree[from]++;
+    if(run.size() == SPILL_RUN_RECORDS){
+      runs.push_back(writeSynapseRun(run));
+    }
+  }
+  if(!run.empty()){
+    runs.push_back(writeSynapseRun(run));
+  }
+
+  //Merge queue entries: (source neuron, run index), target
+  typedef pair<pair<int, int>, int> MergeEntry;
+  priority_queue<MergeEntry, vector<MergeEntry>, greater<MergeEntry> > merge;
+  pair<int, int> record;
+  for(int i=0;i<runs.size();i++){
+    if(fread(&record, sizeof(record), 1, runs[i]) == 1){
+      merge.push(make_pair(make_pair(record.first, i), record.second));
+    }
+  }
+  for(int i=0;i<neuron_count;i++){
+    cout << degree[i] << " ";
+    while(!merge.empty() && merge.top().first.first == i){
+      int run_index = merge.top().first.second;
+      int to = merge.top().second;
+      merge.pop();
+      if(to >= 0){
+        cout << to << " ";
+      }
+      if(fread(&record, sizeof(record), 1, runs[run_index]) == 1){
+        merge.push(make_pair(make_pair(record.first, run_index), record.second));
+      }
+    }
+    cout << '\n';
+  }
+  for(int i=0;i<runs.size();i++){
+    fclose(runs[i]);
+  }
+
+  Rule rule;
+  rewind(spill.rules);
+  while(fread(&rule, sizeof(Rule), 1, spill.rules) == 1){
+    string ids;
+    for(int id=snpsystem.label_neurons[rule.neuron_label];id>=0;id=snpsystem.next_same_label[id]){
+      ids += to_string(id) + " ";
+    }
+    writeRuleLines(cout, ids, snpsystem.regexes.strings[rule.regex], rule.c, rule.p, rule.d, rule_sets);
+  }
+  cout.flush();
+}
+
+//Writes the parsed system in the requested output format
+//returns false if the --blocks file could not be written
+bool outSNP(const char *binary_output, const char *blocks_output, bool rule_sets){
+  if(binary_output != NULL){
+    outBinaryCuSnp(binary_output);
+  } else if(blocks_output != NULL){
+    return outBlocksCuSnp(blocks_output);
+  } else if(spill.rules != NULL){
+    outStreamCuSnp(rule_sets);
+  } else {
+    outCuSnp(rule_sets);
+  }
+  return true;
+}
+
+//Switches ranged @marcs and rule statements to being recorded as families
+//(--blocks) instead of expanded
+void openFamilies(){
+  families.enabled = true;
+}
+
+//Keeps the rules of ranged statements that differ only in the spikes they
+//consume as one set rule per neuron. Rules are then grouped by neuron
+//within each statement, which the simulator and --rule-sets output allow
+void openRuleSets(){
+  snpsystem.rule_sets = true;
+}
+
+//Reads off an expression that is affine in the first levels range variables
+//as its constant and one coefficient per variable, the parameters bound
+//returns false if it is not affine or refers to a deeper range variable
+bool affineExp(const BoundExp& bound, const RangeIterator& ranges, Environment& env, int levels,
+               CuSnpAffine& affine){
+  for(int i=0;i<bound.slots.size();i++){
+    if(bound.slots[i] < 0){
+      return false;
+    }
+    for(int k=levels;k<ranges.slots.size();k++){
+      if(bound.slots[i] == ranges.slots[k]) return false;
+    }
+  }
+  vector<int> slots(ranges.slots.begin(), ranges.slots.begin()+levels);
+  if(!affineIn(bound, slots)){
+    return false;
+  }
+  for(int k=0;k<ranges.slots.size();k++){
+    env.values[ranges.slots[k]] = 0;
+  }
+  affine.constant = evalMathExp(bound, env);
+  affine.coefs.assign(levels, 0);
+  for(int k=0;k<levels;k++){
+    env.values[ranges.slots[k]] = 1;
+    affine.coefs[k] = evalMathExp(bound, env) - affine.constant;
+    env.values[ranges.slots[k]] = 0;
+  }
+  return true;
+}
+
+//Describes the index space of a range iterator as a block nest
+//returns false if a bound or exception is not affine
+bool affineNest(const RangeIterator& ranges, Environment& env, CuSnpNest& nest){
+  int depth = ranges.levels.size();
+  nest.lower.resize(depth);
+  nest.upper.resize(depth);
+  for(int k=0;k<depth;k++){
+    const Range& range = ranges.levels[k];
+    if(!affineExp(range.x1_exp, ranges, env, k, nest.lower[k]) ||
+       !affineExp(range.x2_exp, ranges, env, k, nest.upper[k])){
+      return false;
+    }
+    if(!range.inclusive_x1) nest.lower[k].constant++;
+    if(range.inclusive_x2) nest.upper[k].constant++;
+  }
+  for(int i=0;i<ranges.exceptions.size();i++){
+    CuSnpAffine x1, x2;
+    if(!affineExp(ranges.exceptions[i].x1_exp, ranges, env, depth, x1) ||
+       !affineExp(ranges.exceptions[i].x2_exp, ranges, env, depth, x2)){
+      return false;
+    }
+    x1.constant -= x2.constant;
+    for(int k=0;k<depth;k++){
+      x1.coefs[k] -= x2.coefs[k];
+    }
+    nest.exceptions.push_back(x1);
+  }
+  return true;
+}
+
+//Smallest and largest value each variable of a nest can take, from the
+//bounds taken at the extremes of the enclosing variables. lo > hi if empty
+void nestSpans(const CuSnpNest& nest, vector<pair<long, long> >& spans){
+  spans.clear();
+  bool empty = false;
+  for(int k=0;k<nest.lower.size();k++){
+    long lo = nest.lower[k].constant;
+    long hi = nest.upper[k].constant - 1;
+    for(int j=0;j<k;j++){
+      long coef_lo = nest.lower[k].coefs[j];
+      long coef_hi = nest.upper[k].coefs[j];
+      lo += coef_lo * (coef_lo > 0 ? spans[j].first : spans[j].second);
+      hi += coef_hi * (coef_hi > 0 ? spans[j].second : spans[j].first);
+    }
+    empty = empty || lo > hi;
+    spans.push_back(empty ? make_pair(1L, 0L) : make_pair(lo, hi));
+  }
+}
+
+//Resolves a neuron label of a family to an affine neuron id. The label may
+//use at most one range variable, and every value in that variable's span
+//has to name a declared neuron, the ids stepping evenly; a rule's neuron
+//also has to be the only one with its label
+bool affineEndpoint(const LabelTemplate& label, const RangeIterator& ranges, Environment& env,
+                    const vector<pair<long, long> >& spans, bool rule_neuron, CuSnpAffine& affine){
+  int depth = ranges.levels.size();
+  int level = -1;
+  for(int i=0;i<label.slots.size();i++){
+    for(int k=0;k<depth;k++){
+      if(label.slots[i] != ranges.slots[k]) continue;
+      if(level >= 0 && level != k) return false;
+      level = k;
+    }
+  }
+  affine.coefs.assign(depth, 0);
+  long lo = level < 0 ? 0 : spans[level].first;
+  long hi = level < 0 ? 0 : spans[level].second;
+  if(lo > hi){
+    affine.constant = 0;
+    return true;
+  }
+  int first = -1, step = 0;
+  for(long value=lo;value<=hi;value++){
+    if(level >= 0){
+      env.values[ranges.slots[level]] = value;
+    }
+    int id = findNeuron(renderLabel(label, env));
+    if(id < 0 || (rule_neuron && snpsystem.next_same_label[id] >= 0)){
+      return false;
+    }
+    if(value == lo){
+      first = id;
+    } else if(value == lo+1){
+      step = id - first;
+    } else if(id != first + step*(value-lo)){
+      return false;
+    }
+  }
+  affine.constant = first - (long)step*lo;
+  if(level >= 0){
+    affine.coefs[level] = step;
+  }
+  return true;
+}
+
+//Describes a synapse family as a block record
+//returns false if it has to be written synapse by synapse
+bool blockSynapses(SynapseFamily& family, CuSnpSynapseRecord& record){
+  Environment env = family.env;
+  vector<pair<long, long> > spans;
+  if(!affineNest(family.ranges, env, record.nest)){
+    return false;
+  }
+  nestSpans(record.nest, spans);
+  record.endpoints.resize(family.entry.size()/2*2);
+  for(int i=0;i<record.endpoints.size();i++){
+    if(!affineEndpoint(family.entry[i], family.ranges, env, spans, false, record.endpoints[i])){
+      return false;
+    }
+  }
+  return true;
+}
+
+//Describes a rule family as a block record
+//returns false if it has to be written rule by rule
+bool blockRules(RuleFamily& family, CuSnpRuleRecord& record){
+  Environment env = family.env;
+  int depth = family.ranges.levels.size();
+  vector<pair<long, long> > spans;
+  record.family = true;
+  record.default_regex = family.regex.empty();
+  record.regex = family.regex;
+  if(!affineNest(family.ranges, env, record.nest) ||
+     !affineExp(family.c, family.ranges, env, depth, record.c) ||
+     !affineExp(family.p, family.ranges, env, depth, record.p) ||
+     !affineExp(family.d, family.ranges, env, depth, record.d)){
+    return false;
+  }
+  nestSpans(record.nest, spans);
+  return affineEndpoint(family.neuron, family.ranges, env, spans, true, record.neuron);
+}
+
+void writeSynapsePair(ostream& out, int from, int to){
+  if(from >= 0){
+    out << "s " << from << " " << to << '\n';
+  }
+}
+
+//r records for a rule of the system, one per count of a set rule
+void writeBlockRule(ostream& out, int label, const string& regex, int c, int p, int d){
+  SpikeSet set;
+  if(c != CONSUME_ALL || !parseSpikeSet(regex, set)){
+    writeRuleLine(out, label, regex, c, p, d);
+    return;
+  }
+  vector<long> counts;
+  spikeSetCounts(set, counts);
+  for(int i=0;i<counts.size();i++){
+    writeRuleLine(out, label, "a" + to_string(counts[i]), counts[i], p, d);
+  }
+}
+
+//One r record for the neurons declared with a label
+void writeRuleLine(ostream& out, int label, const string& regex, int c, int p, int d){
+  vector<int> ids;
+  for(int id=label < 0 ? -1 : snpsystem.label_neurons[label];id>=0;id=snpsystem.next_same_label[id]){
+    ids.push_back(id);
+  }
+  out << "r " << ids.size();
+  for(int i=0;i<ids.size();i++){
+    out << " " << ids[i];
+  }
+  out << " " << regex << " " << c << " " << p << " " << d << '\n';
+}
+
+//Writes the system in the block CuSNP format (--blocks). Ranged statements
+//whose bounds, exceptions, labels and rule values are affine become one
+//record each, the others are expanded here as the text output would
+//returns false if the file could not be written
+bool outBlocksCuSnp(const char *filename){
+  int neuron_count = snpsystem.neuron_labels.size();
+  vector<CuSnpSynapseRecord> synapse_blocks(families.synapses.size());
+  vector<stringstream> synapse_lines(families.synapses.size());
+  vector<char> synapse_blocked(families.synapses.size(), 0);
+  long synapse_records = 0;
+  for(int i=0;i<families.synapses.size();i++){
+    SynapseFamily& family = families.synapses[i];
+    synapse_blocked[i] = blockSynapses(family, synapse_blocks[i]);
+    if(synapse_blocked[i]){
+      synapse_records++;
+      continue;
+    }
+    vector<string> labels;
+    expandSynapses(family.ranges, family.env, family.entry, labels);
+    for(int j=0;j+1<labels.size();j+=2){
+      int from = findNeuron(labels[j]);
+      writeSynapsePair(synapse_lines[i], from, findNeuron(labels[j+1]));
+      synapse_records += from >= 0;
+    }
+  }
+  for(long i=0;i<snpsystem.synapse_from.size();i++){
+    synapse_records += snpsystem.label_neurons[snpsystem.synapse_from[i]] >= 0;
+  }
+
+  vector<CuSnpRuleRecord> rule_blocks(families.rules.size());
+  vector<stringstream> rule_lines(families.rules.size());
+  vector<char> rule_blocked(families.rules.size(), 0);
+  long rule_records = 0;
+  for(long i=0;i<snpsystem.rule_c.size();i++){
+    rule_records += ruleLineCount(snpsystem.regexes.strings[snpsystem.rule_regexes[i]], snpsystem.rule_c[i]);
+  }
+  for(int i=0;i<families.rules.size();i++){
+    RuleFamily& family = families.rules[i];
+    rule_blocked[i] = blockRules(family, rule_blocks[i]);
+    if(rule_blocked[i]){
+      rule_records++;
+      continue;
+    }
+    vector<string> labels;
+    vector<Rule> rules;
+    expandRules(family.ranges, family.env, family.neuron, family.c, family.p, family.d, labels, rules);
+    for(int j=0;j<rules.size();j++){
+      string regex = family.regex.empty() ? "a" + to_string(rules[j].c) : family.regex;
+      writeRuleLine(rule_lines[i], findString(snpsystem.labels, labels[j]), regex,
+                    rules[j].c, rules[j].p, rules[j].d);
+    }
+    rule_records += rules.size();
+  }
+
+  ofstream out(filename);
+  out << CUSNP_BLOCKS_MAGIC << " " << CUSNP_BLOCKS_VERSION << '\n';
+  out << neuron_count << '\n';
+  out << snpsystem.simulationsteps << '\n';
+  for(int i=0;i<neuron_count;i++){
+    out << snpsystem.spikes[i] << " ";
+  }
+  out << '\n';
+
+  out << synapse_records << '\n';
+  int family = 0;
+  for(long i=0;i<=snpsystem.synapse_from.size();i++){
+    for(;family<families.synapses.size() && families.synapses[family].position==i;family++){
+      const CuSnpSynapseRecord& record = synapse_blocks[family];
+      if(!synapse_blocked[family]){
+        out << synapse_lines[family].str();
+        continue;
+      }
+      out << "S ";
+      writeCuSnpNest(out, record.nest);
+      out << " " << record.endpoints.size()/2;
+      for(int j=0;j<record.endpoints.size();j++){
+        out << " ";
+        writeCuSnpAffine(out, record.endpoints[j]);
+      }
+      out << '\n';
+    }
+    if(i < snpsystem.synapse_from.size()){
+      writeSynapsePair(out, snpsystem.label_neurons[snpsystem.synapse_from[i]],
+                       snpsystem.label_neurons[snpsystem.synapse_to[i]]);
+    }
+  }
+
+  out << rule_records << '\n';
+  family = 0;
+  for(long i=0;i<=snpsystem.rule_c.size();i++){
+    for(;family<families.rules.size() && families.rules[family].position==i;family++){
+      const CuSnpRuleRecord& record = rule_blocks[family];
+      if(!rule_blocked[family]){
+        out << rule_lines[family].str();
+        continue;
+      }
+      out << "R ";
+      writeCuSnpNest(out, record.nest);
+      out << " ";
+      writeCuSnpAffine(out, record.neuron);
+      out << (record.default_regex ? " 1" : " 0 " + record.regex) << " ";
+      writeCuSnpAffine(out, record.c);
+      out << " ";
+      writeCuSnpAffine(out, record.p);
+      out << " ";
+      writeCuSnpAffine(out, record.d);
+      out << '\n';
+    }
+    if(i < snpsystem.rule_c.size()){
+      writeBlockRule(out, snpsystem.rule_labels[i], string(snpsystem.regexes.strings[snpsystem.rule_regexes[i]]),
+                     snpsystem.rule_c[i], snpsystem.rule_p[i], snpsystem.rule_d[i]);
+    }
+  }
+  out.flush();
+  if(!out){
+    return false;
+  }
+  stats.bytes_written += out.tellp();
+  return true;
+}
+
+//Expands a block CuSNP file to the text format on stdout
+bool convertBlocksToText(const char *blocks_file){
+  ifstream in(blocks_file);
+  CuSnpBlocks blocks;
+  if(!in || !readCuSnpBlocks(in, blocks)){
+    return false;
+  }
+  expandCuSnpBlocks(blocks, cout);
+  return true;
+}
+
+//Returns the id of a regex in the table, adding it on first use
+int internRegex(CuSnpTables& tables, const string& regex){
+  pair<unordered_map<string, int>::iterator, bool> entry = tables.regex_ids.emplace(regex, tables.regexes.size());
+  if(entry.second){
+    tables.regexes.push_back(regex);
+  }
+  return entry.first->second;
+}
+
+//Resolves the in-memory system into binary tables. Synapses to undeclared
+//neurons are kept as -1 targets and a rule shared by neurons with the same
+//label is given one record per neuron, all with the index of its text line
+void tablesFromSNP(CuSnpTables& tables){
+  int neuron_count = snpsystem.neuron_labels.size();
+  tables.simulationsteps = snpsystem.simulationsteps;
+  tables.spikes = snpsystem.spikes;
+
+  Adjacency adjacency = buildAdjacency();
+  tables.synapse_offsets.push_back(0);
+  for(int i=0;i<neuron_count;i++){
+    for(long j=adjacency.offsets[i];j<adjacency.offsets[i+1];j++){
+      tables.synapse_targets.push_back(adjacency.targets[j]);
+    }
+    tables.synapse_offsets.push_back(tables.synapse_targets.size());
+  }
+
+  //pool regex id -> table regex id, tables number regexes by first use
+  vector<int> regex_ids(snpsystem.regexes.strings.size(), -1);
+  SpikeSet set;
+  vector<long> counts;
+  int line = 0;
+  for(int i=0;i<snpsystem.rule_labels.size();i++){
+    //The binary format has no set rules, they go in as their a<k> rules
+    if(snpsystem.rule_c[i] == CONSUME_ALL && parseSpikeSet(snpsystem.regexes.strings[snpsystem.rule_regexes[i]], set)){
+      spikeSetCounts(set, counts);
+      for(int j=0;j<counts.size();j++){
+        CuSnpBinaryRule rule;
+        rule.c = counts[j];
+        rule.p = snpsystem.rule_p[i];
+        rule.d = snpsystem.rule_d[i];
+        rule.regex = internRegex(tables, "a" + to_string(counts[j]));
+        rule.line = line++;
+        int id = snpsystem.label_neurons[snpsystem.rule_labels[i]];
+        do{
+          rule.neuron = id;
+          tables.rules.push_back(rule);
+          id = id >= 0 ? snpsystem.next_same_label[id] : -1;
+        }while(id >= 0);
+      }
+      continue;
+    }
+    CuSnpBinaryRule rule;
+    rule.c = snpsystem.rule_c[i];
+    rule.p = snpsystem.rule_p[i];
+    rule.d = snpsystem.rule_d[i];
+    int& regex = regex_ids[snpsystem.rule_regexes[i]];
+    if(regex < 0){
+      regex = internRegex(tables, string(snpsystem.regexes.strings[snpsystem.rule_regexes[i]]));
+    }
+    rule.regex = regex;
+    rule.line = line++;
+    int id = snpsystem.label_neurons[snpsystem.rule_labels[i]];
+    do{
+      rule.neuron = id;
+      tables.rules.push_back(rule);
+      id = id >= 0 ? snpsystem.next_same_label[id] : -1;
+    }while(id >= 0);
+  }
+}
+
+//Reads a text CuSNP file (as produced by outCuSnp) into binary tables
+//returns false if the file cannot be read, is truncated or has a field that
+//is not a number
+bool tablesFromText(const char *filename, CuSnpTables& tables){
+  ifstream file(filename);
+  if(!file.is_open()){
+    return false;
+  }
+  string buffer;
+  long neuron_count, rule_count, value;
+  if(!getline(file, buffer) || !parseInteger(trim(buffer), neuron_count) || neuron_count < 0) return false;
+  if(!getline(file, buffer) || !parseInteger(trim(buffer), rule_count) || rule_count < 0) return false;
+  if(!getline(file, buffer) || !parseInteger(trim(buffer), value)) return false;
+  tables.simulationsteps = value;
+
+  if(!getline(file, buffer)) return false;
+  vector<string> tokens = whitespace_split(buffer);
+  for(int i=0;i<tokens.size();i++){
+    if(!parseInteger(tokens[i], value)) return false;
+    tables.spikes.push_back(value);
+  }
+  tables.spikes.resize(neuron_count, 0);
+
+  tables.synapse_offsets.push_back(0);
+  for(long i=0;i<neuron_count;i++){
+    if(!getline(file, buffer)) return false;
+    tokens = whitespace_split(buffer);
+    if(tokens.empty() || !parseInteger(tokens[0], value)) return false;
+    for(int j=1;j<tokens.size();j++){
+      int target;
+      if(!parseInt(tokens[j], target)) return false;
+      tables.synapse_targets.push_back(target);
+    }
+    //The count includes synapses to undeclared neurons, which are not listed
+    for(long j=tokens.size()-1;j<value;j++){
+      tables.synapse_targets.push_back(-1);
+    }
+    tables.synapse_offsets.push_back(tables.synapse_targets.size());
+  }
+
+  //Rule lines are: neuron id(s), regex, c, p, d. Set rules (--rule-sets) are
+  //expanded to their a<k> rules
+  SpikeSet set;
+  vector<long> counts;
+  int line = 0;
+  for(long i=0;i<rule_count;i++){
+    if(!getline(file, buffer)) return false;
+    tokens = whitespace_split(buffer);
+    if(tokens.size() < 4) return false;
+    int fields = tokens.size();
+    CuSnpBinaryRule rule;
+    if(!parseInt(tokens[fields-3], rule.c) || !parseInt(tokens[fields-2], rule.p) ||
+       !parseInt(tokens[fields-1], rule.d)){
+      return false;
+    }
+    counts.assign(1, rule.c);
+    bool expand = rule.c == CONSUME_ALL && parseSpikeSet(tokens[fields-4], set);
+    if(expand){
+      spikeSetCounts(set, counts);
+    }
+    for(int k=0;k<counts.size();k++){
+      rule.line = line++;
+      rule.c = counts[k];
+      rule.regex = internRegex(tables, expand ? "a" + to_string(counts[k]) : tokens[fields-4]);
+      rule.neuron = -1;
+      if(fields == 4){
+        tables.rules.push_back(rule);
+      }
+      for(int j=0;j<fields-4;j++){
+        if(!parseInt(tokens[j], rule.neuron)) return false;
+        tables.rules.push_back(rule);
+      }
+    }
+  }
+  return true;
+}
+
+//Pads a file to the next 8 byte boundary and returns the new offset
+uint64_t alignBinary(FILE *file, uint64_t offset){
+  const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  uint64_t aligned = (offset + 7) & ~(uint64_t)7;
+  fwrite(zeros, 1, aligned - offset, file);
+  return aligned;
+}
+
+bool writeCuSnpBinary(const char *filename, const CuSnpTables& tables){
+  FILE *file = fopen(filename, "wb");
+  if(file == NULL){
+    return false;
+  }
+  CuSnpBinaryHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CUSNP_BINARY_MAGIC, sizeof(header.magic));
+  header.version = CUSNP_BINARY_VERSION;
+  header.header_size = sizeof(header);
+  header.neuron_count = tables.spikes.size();
+  header.rule_count = tables.rules.size();
+  header.synapse_count = tables.synapse_targets.size();
+  header.regex_count = tables.regexes.size();
+  header.simulation_steps = tables.simulationsteps;
+
+  vector<uint64_t> regex_offsets(1, 0);
+  vector<uint64_t> progression_offsets(1, 0);
+  vector<CuSnpBinaryProgression> progressions;
+  vector<Progression> compiled;
+  for(int i=0;i<tables.regexes.size();i++){
+    regex_offsets.push_back(regex_offsets.back() + tables.regexes[i].length() + 1);
+    if(compileProgressions(tables.regexes[i], compiled)){
+      for(int j=0;j<compiled.size();j++){
+        CuSnpBinaryProgression progression = {compiled[j].offset, compiled[j].period};
+        progressions.push_back(progression);
+      }
+    }
+    progression_offsets.push_back(progressions.size());
+  }
+  header.progression_count = progressions.size();
+
+  //Lay out the sections, each aligned to 8 bytes
+  uint64_t offset = sizeof(header);
+  header.spikes_offset = offset;
+  offset += tables.spikes.size() * sizeof(int64_t);
+  header.synapse_offsets_offset = offset;
+  offset += tables.synapse_offsets.size() * sizeof(uint64_t);
+  header.synapse_targets_offset = offset;
+  offset = (offset + tables.synapse_targets.size() * sizeof(int32_t) + 7) & ~(uint64_t)7;
+  header.rules_offset = offset;
+  offset += tables.rules.size() * sizeof(CuSnpBinaryRule);
+  header.regex_offsets_offset = offset;
+  offset += regex_offsets.size() * sizeof(uint64_t);
+  header.regex_data_offset = offset;
+  offset = (offset + regex_offsets.back() + 7) & ~(uint64_t)7;
+  header.progression_offsets_offset = offset;
+  offset += progression_offsets.size() * sizeof(uint64_t);
+  header.progressions_offset = offset;
+  header.file_size = offset + progressions.size() * sizeof(CuSnpBinaryProgression);
+
+  fwrite(&header, sizeof(header), 1, file);
+  fwrite(tables.spikes.data(), sizeof(int64_t), tables.spikes.size(), file);
+  fwrite(tables.synapse_offsets.data(), sizeof(uint64_t), tables.synapse_offsets.size(), file);
+  fwrite(tables.synapse_targets.data(), sizeof(int32_t), tables.synapse_targets.size(), file);
+  alignBinary(file, header.synapse_targets_offset + tables.synapse_targets.size() * sizeof(int32_t));
+  fwrite(tables.rules.data(), sizeof(CuSnpBinaryRule), tables.rules.size(), file);
+  fwrite(regex_offsets.data(), sizeof(uint64_t), regex_offsets.size(), file);
+  for(int i=0;i<tables.regexes.size();i++){
+    fwrite(tables.regexes[i].c_str(), 1, tables.regexes[i].length() + 1, file);
+  }
+  alignBinary(file, header.regex_data_offset + regex_offsets.back());
+  fwrite(progression_offsets.data(), sizeof(uint64_t), progression_offsets.size(), file);
+  fwrite(progressions.data(), sizeof(CuSnpBinaryProgression), progressions.size(), file);
+  stats.bytes_written += header.file_size;
+  return fclose(file) == 0;
+}
+
+void outBinaryCuSnp(const char *filename){
+  CuSnpTables tables;
+  tablesFromSNP(tables);
+  if(!writeCuSnpBinary(filename, tables)){
+    //cout << "Cannot write \"" << filename << "\"" << endl;
+  }
+}
+
+bool convertTextToBinary(const char *text_file, const char *binary_file){
+  CuSnpTables tables;
+  return tablesFromText(text_file, tables) && writeCuSnpBinary(binary_file, tables);
+}
+
+//Prints a binary CuSNP file in the text format
+bool convertBinaryToText(const char *binary_file){
+  const CuSnpBinaryHeader *header = mapCuSnpBinary(binary_file);
+  if(header == NULL){
+    return false;
+  }
+  const int64_t *spikes = cusnpSpikes(header);
+  const uint64_t *synapse_offsets = cusnpSynapseOffsets(header);
+  const int32_t *synapse_targets = cusnpSynapseTargets(header);
+  const CuSnpBinaryRule *rules = cusnpRules(header);
+
+  cout << header->neuron_count << '\n';
+  cout << (header->rule_count == 0 ? 0 : rules[header->rule_count-1].line + 1) << '\n';
+  cout << header->simulation_steps << '\n';
+  for(uint64_t i=0;i<header->neuron_count;i++){
+    cout << spikes[i] << " ";
+  }
+  cout << '\n';
+  for(uint64_t i=0;i<header->neuron_count;i++){
+    cout << synapse_offsets[i+1] - synapse_offsets[i] << " ";
+    for(uint64_t j=synapse_offsets[i];j<synapse_offsets[i+1];j++){
+      if(synapse_targets[j] >= 0){
+        cout << synapse_targets[j] << " ";
+      }
+    }
+    cout << '\n';
+  }
+  //Records of one line list their neurons before the shared rule
+  for(uint64_t i=0;i<header->rule_count;i++){
+    if(rules[i].neuron >= 0){
+      cout << rules[i].neuron << " ";
+    }
+    if(i+1 == header->rule_count || rules[i+1].line != rules[i].line){
+      cout << cusnpRegex(header, rules[i].regex) << " " << rules[i].c << " " << rules[i].p << " " << rules[i].d << '\n';
+    }
+  }
+  cout.flush();
+  unmapCuSnpBinary(header);
+  return true;
+}
+
+//Prints a CuSNP text file written with --rule-sets with its set rules
+//expanded, for tools that only read the plain text format
+bool convertRuleSetsToText(const char *text_file){
+  ifstream file(text_file);
+  string buffer;
+  vector<string> header;
+  for(int i=0;i<4 && getline(file, buffer);i++){
+    header.push_back(buffer);
+  }
+  if(header.size() < 4 || !is_number(header[0]) || !is_number(header[1])){
+    return false;
+  }
+  long neuron_count = stol(header[0]);
+  long rule_count = stol(header[1]);
+  vector<string> synapse_lines;
+  for(long i=0;i<neuron_count && getline(file, buffer);i++){
+    synapse_lines.push_back(buffer);
+  }
+  stringstream rules;
+  long rule_lines = 0;
+  for(long i=0;i<rule_count;i++){
+    if(!getline(file, buffer)) return false;
+    vector<string> tokens = whitespace_split(buffer);
+    if(tokens.size() < 4) return false;
+    int fields = tokens.size();
+    string ids;
+    for(int j=0;j<fields-4;j++){
+      ids += tokens[j] + " ";
+    }
+    int c = stoi(tokens[fields-3]);
+    rule_lines += ruleLineCount(tokens[fields-4], c);
+    writeRuleLines(rules, ids, tokens[fields-4], c, stoi(tokens[fields-2]), stoi(tokens[fields-1]), false);
+  }
+  if(synapse_lines.size() < neuron_count){
+    return false;
+  }
+  cout << header[0] << '\n' << rule_lines << '\n' << header[2] << '\n' << header[3] << '\n';
+  for(long i=0;i<neuron_count;i++){
+    cout << synapse_lines[i] << '\n';
+  }
+  cout << rules.rdbuf();
+  cout.flush();
+  return true;
+}
+
+//Starts the worker threads of a pool, the calling thread works as well
+void startThreadPool(int threads){
+  for(int i=1;i<threads;i++){
+    thread_pool.workers.push_back(thread(workerLoop));
+  }
+}
+
+void stopThreadPool(){
+  {
+    lock_guard<mutex> guard(thread_pool.lock);
+    thread_pool.stopping = true;
+  }
+  thread_pool.wake.notify_all();
+  for(int i=0;i<thread_pool.workers.size();i++){
+    thread_pool.workers[i].join();
+  }
+  thread_pool.workers.clear();
+}
+
+void workerLoop(){
+  long seen = 0;
+  unique_lock<mutex> guard(thread_pool.lock);
+  while(true){
+    thread_pool.wake.wait(guard, [&]{ return thread_pool.stopping || thread_pool.generation != seen; });
+    if(thread_pool.stopping){
+      return;
+    }
+    seen = thread_pool.generation;
+    guard.unlock();
+    runChunks();
+    guard.lock();
+    if(--thread_pool.remaining == 0){
+      thread_pool.finished.notify_all();
+    }
+  }
+}
+
+void runChunks(){
+  long begin;
+  while((begin = thread_pool.next.fetch_add(thread_pool.chunk)) < thread_pool.job_size){
+    (*thread_pool.job)(begin, min(begin+thread_pool.chunk, thread_pool.job_size));
+  }
+}
+
+//Runs job over [0, n) split into chunks shared by every thread of the pool
+//and returns once all of them are done
+void parallelFor(long n, const function<void(long, long)>& job){
+  if(thread_pool.workers.empty() || n < PARALLEL_MIN_ITEMS){
+    job(0, n);
+    return;
+  }
+  dispatchJob(n, max(PARALLEL_MIN_ITEMS/4, n/(long)(thread_pool.workers.size()+1)/8 + 1), job);
+}
+
+//Hands [0, n) to the pool in chunks of the given size, the calling thread
+//takes chunks as well
+void dispatchJob(long n, long chunk, const function<void(long, long)>& job){
+  {
+    lock_guard<mutex> guard(thread_pool.lock);
+    thread_pool.job = &job;
+    thread_pool.job_size = n;
+    thread_pool.chunk = chunk;
+    thread_pool.next = 0;
+    thread_pool.remaining = thread_pool.workers.size();
+    thread_pool.generation++;
+  }
+  thread_pool.wake.notify_all();
+  runChunks();
+  unique_lock<mutex> guard(thread_pool.lock);
+  thread_pool.finished.wait(guard, [&]{ return thread_pool.remaining == 0; });
+}
+
+//Compiles every rule regex that is a union of progressions, such as a*, a5,
+//aaa, a2(a3)* or a|a(aa)+, so rules are matched with integer tests
+void compileRuleRegexes(){
+  snpsystem.progression_offsets.assign(1, 0);
+  snpsystem.progressions.clear();
+  vector<Progression> progressions;
+  for(int i=0;i<snpsystem.regexes.strings.size();i++){
+    if(compileProgressions(snpsystem.regexes.strings[i], progressions)){
+      snpsystem.progressions.insert(snpsystem.progressions.end(), progressions.begin(), progressions.end());
+    }
+    snpsystem.progression_offsets.push_back(snpsystem.progressions.size());
+  }
+}
+
+//Compiles a regex over a, where a<k> stands for k a's, into its canonical
+//union of progressions: sorted by ascending period, single counts last, with
+//none contained in another
+//returns false if it is not a union of progressions this can build
+bool compileProgressions(string_view regex, vector<Progression>& progressions){
+  size_t pos = 0;
+  if(!progressionUnion(regex, pos, progressions) || pos != regex.size()){
+    return false;
+  }
+  //A progression can only be contained in one whose period divides its own,
+  //or in any progression if it is a single count, so those come first
+  sort(progressions.begin(), progressions.end(), [](const Progression& a, const Progression& b){
+    if(a.period != b.period){
+      return b.period == 0 || (a.period != 0 && a.period < b.period);
+    }
+    return a.offset < b.offset;
+  });
+  vector<Progression> kept;
+  for(int i=0;i<progressions.size();i++){
+    const Progression& p = progressions[i];
+    bool contained = false;
+    for(int j=0;j<kept.size() && !contained;j++){
+      const Progression& q = kept[j];
+      contained = q.period == 0 ? p.period == 0 && p.offset == q.offset :
+                  p.offset >= q.offset && (p.offset-q.offset) % q.period == 0 && p.period % q.period == 0;
+    }
+    if(!contained){
+      kept.push_back(p);
+    }
+  }
+  progressions.swap(kept);
+  return true;
+}
+
+//Alternatives separated by |, up to a ) or the end of the regex
+bool progressionUnion(string_view regex, size_t& pos, vector<Progression>& set){
+  set.clear();
+  vector<Progression> term;
+  while(true){
+    if(!progressionTerm(regex, pos, term)){
+      return false;
+    }
+    set.insert(set.end(), term.begin(), term.end());
+    if(set.size() > PROGRESSION_LIMIT){
+      return false;
+    }
+    if(pos == regex.size() || regex[pos] != '|'){
+      return true;
+    }
+    pos++;
+  }
+}
+
+//A concatenation of a, a<k> and (...) each optionally followed by *, + or ?
+bool progressionTerm(string_view regex, size_t& pos, vector<Progression>& set){
+  set.assign(1, Progression{0, 0});
+  vector<Progression> atom;
+  while(pos < regex.size() && regex[pos] != '|' && regex[pos] != ')'){
+    if(regex[pos] == 'a'){
+      long count = 0;
+      size_t digits = ++pos;
+      while(pos < regex.size() && isdigit(regex[pos]) && pos-digits < 9){
+        count = count*10 + (regex[pos++] - '0');
+      }
+      atom.assign(1, Progression{pos == digits ? 1 : count, 0});
+      //a<k> is a{k} to std::regex, so a ? after it only makes it lazy
+      if(pos != digits && pos < regex.size() && regex[pos] == '?'){
+        pos++;
+      }
+    } else if(regex[pos] == '('){
+      pos++;
+      if(!progressionUnion(regex, pos, atom) || pos == regex.size() || regex[pos] != ')'){
+        return false;
+      }
+      pos++;
+    } else {
+      return false;
+    }
+    char op = pos < regex.size() ? regex[pos] : 0;
+    if(op == '*' || op == '+'){
+      //Only a fixed count repeats as a progression
+      if(atom.size() != 1 || atom[0].period != 0){
+        return false;
+      }
+      Progression repeated = {op == '+' ? atom[0].offset : 0, atom[0].offset};
+      atom.assign(1, repeated);
+      pos++;
+      if(pos < regex.size() && regex[pos] == '?'){
+        pos++;
+      }
+    } else if(op == '?'){
+      atom.push_back(Progression{0, 0});
+      pos++;
+    }
+    if(!concatProgressions(set, atom)){
+      return false;
+    }
+  }
+  return true;
+}
+
+//Replaces set with the sums of its progressions and next's. Two periods
+//only sum to a progression if one of them is 0 or they are equal
+bool concatProgressions(vector<Progression>& set, const vector<Progression>& next){
+  vector<Progression> sums;
+  for(int i=0;i<set.size();i++){
+    for(int j=0;j<next.size();j++){
+      long p = set[i].period, q = next[j].period;
+      if(p != 0 && q != 0 && p != q){
+        return false;
+      }
+      sums.push_back(Progression{set[i].offset + next[j].offset, max(p, q)});
+    }
+  }
+  if(sums.size() > PROGRESSION_LIMIT){
+    return false;
+  }
+  set.swap(sums);
+  return true;
+}
+
+bool progressionsMatch(const Progression *progressions, int count, long spikes){
+  for(int i=0;i<count;i++){
+    long offset = progressions[i].offset, period = progressions[i].period;
+    if(period == 0 ? spikes == offset : spikes >= offset && (spikes-offset) % period == 0){
+      return true;
+    }
+  }
+  return false;
+}
+
+//Rewrites a CuSNP regex into ECMAScript syntax: a5 stands for a{5}
+string toStdRegex(const string& regex){
+  string translated;
+  for(int i=0;i<regex.length();i++){
+    translated += regex.at(i);
+    if(regex.at(i) == 'a' && i+1 < regex.length() && isdigit(regex.at(i+1))){
+      translated += '{';
+      while(i+1 < regex.length() && isdigit(regex.at(i+1))){
+        translated += regex.at(++i);
+      }
+      translated += '}';
+    }
+  }
+  return translated;
+}
+
+//Picks how a rule's regex is matched: a set rule by its spike set, a regex
+//compiled to progressions by integer tests, anything else with std::regex
+void compileSimRegex(Simulator& sim, int regex_id, int rule){
+  SimRegex& matcher = sim.rule_regexes[rule];
+  string regex(snpsystem.regexes.strings[regex_id]);
+  long first = snpsystem.progression_offsets[regex_id];
+  matcher.progressions = snpsystem.progressions.data() + first;
+  matcher.progression_count = snpsystem.progression_offsets[regex_id+1] - first;
+  if(sim.rule_c[rule] == CONSUME_ALL && parseSpikeSet(regex, matcher.spike_set)){
+    matcher.set = true;
+  } else if(matcher.progression_count == 0){
+    matcher.pattern = regex_cache.find(regex);
+    if(matcher.pattern == regex_cache.end()){
+      matcher.pattern = regex_cache.emplace(regex, std::regex(toStdRegex(regex))).first;
+    }
+  }
+}
+
+bool regexMatches(const SimRegex& matcher, long spikes){
+  if(matcher.progression_count > 0){
+    return progressionsMatch(matcher.progressions, matcher.progression_count, spikes);
+  }
+  if(matcher.set){
+    const SpikeSet& set = matcher.spike_set;
+    return spikes >= set.low && spikes <= set.high &&
+           !binary_search(set.excluded.begin(), set.excluded.end(), spikes);
+  }
+  return regex_match(string(spikes, 'a'), matcher.pattern->second);
+}
+
+bool ruleApplicable(const Simulator& sim, int rule, long spikes){
+  return spikes >= sim.rule_c[rule] && regexMatches(sim.rule_regexes[rule], spikes);
+}
+
+//Builds the simulator's view of the parsed system: initial configuration,
+//rules grouped by neuron and the incoming synapses of every neuron. A rule
+//shared by neurons with the same label becomes one simulator rule per
+//neuron, as in the text output; rules of undeclared neurons are left out
+void buildSimulator(Simulator& sim){
+  int neuron_count = snpsystem.neuron_labels.size();
+  sim.config.assign(snpsystem.spikes.begin(), snpsystem.spikes.end());
+  sim.next_config.resize(neuron_count);
+  sim.spiking.assign(neuron_count, -1);
+
+  sim.neuron_rules.offsets.assign(neuron_count+1, 0);
+  for(int i=0;i<snpsystem.rule_labels.size();i++){
+    for(int id=snpsystem.label_neurons[snpsystem.rule_labels[i]];id>=0;id=snpsystem.next_same_label[id]){
+      sim.rule_neurons.push_back(id);
+      sim.rule_c.push_back(snpsystem.rule_c[i]);
+      sim.rule_p.push_back(snpsystem.rule_p[i]);
+      sim.rule_regexes.push_back(SimRegex());
+      compileSimRegex(sim, snpsystem.rule_regexes[i], sim.rule_regexes.size()-1);
+      sim.neuron_rules.offsets[id+1]++;
+    }
+  }
+  int rule_count = sim.rule_neurons.size();
+  for(int i=0;i<neuron_count;i++){
+    sim.neuron_rules.offsets[i+1] += sim.neuron_rules.offsets[i];
+  }
+  vector<long> fill(sim.neuron_rules.offsets.begin(), sim.neuron_rules.offsets.end()-1);
+  sim.neuron_rules.targets.resize(sim.neuron_rules.offsets[neuron_count]);
+  for(int i=0;i<rule_count;i++){
+    sim.neuron_rules.targets[fill[sim.rule_neurons[i]]++] = i;
+  }
+
+  //Transpose the outgoing adjacency so every neuron can gather its input
+  Adjacency outgoing = buildAdjacency();
+  Adjacency incoming;
+  incoming.offsets.assign(neuron_count+1, 0);
+  for(long i=0;i<outgoing.targets.size();i++){
+    if(outgoing.targets[i] >= 0){
+      incoming.offsets[outgoing.targets[i]+1]++;
+    }
+  }
+  for(int i=0;i<neuron_count;i++){
+    incoming.offsets[i+1] += incoming.offsets[i];
+  }
+  fill.assign(incoming.offsets.begin(), incoming.offsets.end()-1);
+  incoming.targets.resize(incoming.offsets[neuron_count]);
+  for(int i=0;i<neuron_count;i++){
+    for(long j=outgoing.offsets[i];j<outgoing.offsets[i+1];j++){
+      if(outgoing.targets[j] >= 0){
+        incoming.targets[fill[outgoing.targets[j]]++] = i;
+      }
+    }
+  }
+  outgoing = Adjacency();
+
+  //Sources come out ascending, and ranged @marcs make long runs of them, so
+  //a neuron's input is kept as runs it can sum without gathering
+  sim.incoming.offsets.assign(1, 0);
+  sim.incoming.targets.clear();
+  for(int i=0;i<neuron_count;i++){
+    for(long j=incoming.offsets[i];j<incoming.offsets[i+1];j++){
+      int source = incoming.targets[j];
+      if(j > incoming.offsets[i] && source == sim.incoming.targets.back() + sim.run_lengths.back()){
+        sim.run_lengths.back()++;
+      } else {
+        sim.incoming.targets.push_back(source);
+        sim.run_lengths.push_back(1);
+      }
+    }
+    sim.incoming.offsets.push_back(sim.incoming.targets.size());
+  }
+  sim.emitted.resize(neuron_count);
+#ifdef SNP_AVX2_KERNEL
+  sim.avx2 = step_kernel != KERNEL_SCALAR && __builtin_cpu_supports("avx2");
+#endif
+  buildSpikeTables(sim);
+}
+
+//Tabulates, for every neuron whose rules are all spike sets or progressions,
+//which of its rules apply to each spike count. Past the largest count a
+//rule names, applicability only repeats with the periods of its progressions,
+//so a table of that many counts plus one period answers every count
+void buildSpikeTables(Simulator& sim){
+  long neuron_count = sim.config.size();
+  sim.table_offsets.assign(neuron_count+1, 0);
+  sim.table_bases.assign(neuron_count, 0);
+  for(long i=0;i<neuron_count;i++){
+    long base, period;
+    if(spikeTableSpan(sim, i, base, period)){
+      sim.table_bases[i] = base;
+      sim.table_offsets[i+1] = base + period;
+    }
+    sim.table_offsets[i+1] += sim.table_offsets[i];
+  }
+  sim.rule_masks.assign(sim.table_offsets[neuron_count], 0);
+  parallelFor(neuron_count, [&](long begin, long end){
+    for(long i=begin;i<end;i++){
+      long first = sim.table_offsets[i];
+      for(long spikes=0;spikes<sim.table_offsets[i+1]-first;spikes++){
+        uint64_t mask = 0;
+        for(long j=sim.neuron_rules.offsets[i];j<sim.neuron_rules.offsets[i+1];j++){
+          if(ruleApplicable(sim, sim.neuron_rules.targets[j], spikes)){
+            mask |= (uint64_t)1 << (j - sim.neuron_rules.offsets[i]);
+          }
+        }
+        sim.rule_masks[first + spikes] = mask;
+      }
+    }
+  });
+}
+
+//Counts a neuron's table has to cover: base, past which no count a rule
+//names is left, then one period of its progressions
+//returns false if the neuron gets no table
+bool spikeTableSpan(const Simulator& sim, long neuron, long& base, long& period){
+  long rules = sim.neuron_rules.offsets[neuron+1] - sim.neuron_rules.offsets[neuron];
+  if(rules == 0 || rules > SPIKE_TABLE_RULES){
+    return false;
+  }
+  base = 0;
+  period = 1;
+  for(long j=sim.neuron_rules.offsets[neuron];j<sim.neuron_rules.offsets[neuron+1];j++){
+    int rule = sim.neuron_rules.targets[j];
+    const SimRegex& matcher = sim.rule_regexes[rule];
+    base = max(base, (long)sim.rule_c[rule]);
+    if(matcher.progression_count > 0){
+      for(int k=0;k<matcher.progression_count;k++){
+        const Progression& progression = matcher.progressions[k];
+        base = max(base, progression.offset + (progression.period == 0));
+        if(progression.period > 0){
+          period = period / __gcd(period, progression.period) * progression.period;
+        }
+        if(period > SPIKE_TABLE_MAX) return false;
+      }
+    } else if(matcher.set){
+      base = max(base, matcher.spike_set.high + 1);
+    } else {
+      return false;
+    }
+  }
+  return base + period <= SPIKE_TABLE_MAX;
+}
+
+//Looks up the bitmask of a neuron's rules applicable to a spike count
+//returns false if the neuron has no table, its rules then have to be tested
+bool applicableRules(const Simulator& sim, long neuron, long spikes, uint64_t& mask){
+  long first = sim.table_offsets[neuron];
+  long size = sim.table_offsets[neuron+1] - first;
+  if(size == 0 || spikes < 0){
+    return false;
+  }
+  if(spikes >= size){
+    long base = sim.table_bases[neuron];
+    spikes = base + (spikes - base) % (size - base);
+  }
+  mask = sim.rule_masks[first + spikes];
+  return true;
+}
+
+//Computes the spiking vector S_k for neurons [begin, end): every neuron
+//fires the first of its rules that is applicable to its spike count
+void chooseSpikingRules(Simulator& sim, long begin, long end){
+  for(long i=begin;i<end;i++){
+    sim.spiking[i] = firstApplicableRule(sim, i, sim.config[i]);
+  }
+}
+
+//returns -1 if none of the neuron's rules is applicable
+int firstApplicableRule(const Simulator& sim, long neuron, long spikes){
+  uint64_t mask;
+  if(applicableRules(sim, neuron, spikes, mask)){
+    return mask == 0 ? -1 : sim.neuron_rules.targets[sim.neuron_rules.offsets[neuron] + __builtin_ctzll(mask)];
+  }
+  for(long j=sim.neuron_rules.offsets[neuron];j<sim.neuron_rules.offsets[neuron+1];j++){
+    int rule = sim.neuron_rules.targets[j];
+    if(ruleApplicable(sim, rule, spikes)){
+      return rule;
+    }
+  }
+  return -1;
+}
+
+//Spikes sent by neurons [begin, end): p of the rule each one fires, 0 if none
+void emitSpikes(const Simulator& sim, const vector<int>& spiking, vector<long>& emitted, long begin, long end){
+  for(long i=begin;i<end;i++){
+    emitted[i] = spiking[i] >= 0 ? sim.rule_p[spiking[i]] : 0;
+  }
+}
+
+//Computes C_{k+1} = C_k + S_k * M for neurons [begin, end). The transition
+//matrix is applied in factored form instead of being materialized: the row
+//of a rule holds -c at its own neuron and +p at each of that neuron's targets,
+//so each neuron subtracts what it consumes and sums what its inputs emit
+void applyTransition(const Simulator& sim, const vector<long>& config, const vector<int>& spiking,
+                     const vector<long>& emitted, vector<long>& next, long begin, long end){
+  for(long i=begin;i<end;i++){
+    long spikes = config[i];
+    if(spiking[i] >= 0){
+      spikes -= sim.rule_c[spiking[i]] == CONSUME_ALL ? config[i] : sim.rule_c[spiking[i]];
+    }
+    next[i] = spikes;
+  }
+  if(sim.avx2){
+    accumulateAvx2(sim, emitted.data(), next.data(), begin, end);
+  } else {
+    accumulateScalar(sim, emitted.data(), next.data(), begin, end);
+  }
+}
+
+//Adds to every neuron of [begin, end) what its input runs emit
+void accumulateScalar(const Simulator& sim, const long *emitted, long *next, long begin, long end){
+  for(long i=begin;i<end;i++){
+    long spikes = 0;
+    for(long r=sim.incoming.offsets[i];r<sim.incoming.offsets[i+1];r++){
+      const long *source = emitted + sim.incoming.targets[r];
+      for(int j=0;j<sim.run_lengths[r];j++){
+        spikes += source[j];
+      }
+    }
+    next[i] += spikes;
+  }
+}
+
+//accumulateScalar summing each run eight neurons per iteration, as two
+//unaligned 4-wide loads into two accumulators, so no gather or scatter is
+//needed
+#ifdef SNP_AVX2_KERNEL
+__attribute__((target("avx2")))
+void accumulateAvx2(const Simulator& sim, const long *emitted, long *next, long begin, long end){
+  for(long i=begin;i<end;i++){
+    __m256i sum0 = _mm256_setzero_si256();
+    __m256i sum1 = _mm256_setzero_si256();
+    long spikes = 0;
+    for(long r=sim.incoming.offsets[i];r<sim.incoming.offsets[i+1];r++){
+      const long *source = emitted + sim.incoming.targets[r];
+      int length = sim.run_lengths[r];
+      int j = 0;
+      for(;j+8<=length;j+=8){
+        sum0 = _mm256_add_epi64(sum0, _mm256_loadu_si256((const __m256i*)(source+j)));
+        sum1 = _mm256_add_epi64(sum1, _mm256_loadu_si256((const __m256i*)(source+j+4)));
+      }
+      for(;j<length;j++){
+        spikes += source[j];
+      }
+    }
+    long lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, _mm256_add_epi64(sum0, sum1));
+    next[i] += spikes + lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+}
+#else
+void accumulateAvx2(const Simulator& sim, const long *emitted, long *next, long begin, long end){
+  accumulateScalar(sim, emitted, next, begin, end);
+}
+#endif
+
+//Chooses the transition kernel (--kernel): the AVX2 one by default when the
+//CPU has it, which --kernel scalar turns off
+void selectKernel(int kernel){
+  step_kernel = kernel;
+}
+
+void printConfiguration(int step, const vector<long>& config){
+  cout << step << ":";
+  for(int i=0;i<config.size();i++){
+    cout << " " << config[i];
+  }
+  cout << '\n';
+}
+
+//Simulates the parsed system for snpsystem.simulationsteps steps with the
+//matrix representation (rule delays are not part of it and are ignored),
+//printing the configuration reached after every step. Stops early once no
+//rule is applicable
+void simulateSNP(){
+  Simulator sim;
+  buildSimulator(sim);
+  long neuron_count = sim.config.size();
+  function<void(long, long)> choose = [&](long begin, long end){ chooseSpikingRules(sim, begin, end); };
+  function<void(long, long)> emit = [&](long begin, long end){ emitSpikes(sim, sim.spiking, sim.emitted, begin, end); };
+  function<void(long, long)> apply = [&](long begin, long end){
+    applyTransition(sim, sim.config, sim.spiking, sim.emitted, sim.next_config, begin, end);
+  };
+
+  printConfiguration(0, sim.config);
+  for(int step=1;step<=snpsystem.simulationsteps;step++){
+    parallelFor(neuron_count, choose);
+    if(count(sim.spiking.begin(), sim.spiking.end(), -1) == neuron_count){
+      break;
+    }
+    parallelFor(neuron_count, emit);
+    parallelFor(neuron_count, apply);
+    sim.config.swap(sim.next_config);
+    printConfiguration(step, sim.config);
+  }
+  cout.flush();
+}
+
+//Inserts config into the explored set, returns false if it was already there
+bool insertConfiguration(ConfigSet& explored, const vector<long>& config){
+  size_t hash = ConfigHash()(config);
+  ConfigShard& shard = explored.shards[hash % CONFIG_SET_SHARDS];
+  lock_guard<mutex> guard(shard.lock);
+  return shard.configs.insert(config).second;
+}
+
+//Pops a configuration from the worker's own deque, or steals the oldest one
+//from another worker once its own deque is empty
+bool takeConfiguration(vector<WorkDeque>& deques, int worker, vector<long>& config){
+  {
+    WorkDeque& own = deques[worker];
+    lock_guard<mutex> guard(own.lock);
+    if(!own.configs.empty()){
+      config.swap(own.configs.back());
+      own.configs.pop_back();
+      return true;
+    }
+  }
+  for(int i=1;i<deques.size();i++){
+    WorkDeque& victim = deques[(worker+i) % deques.size()];
+    lock_guard<mutex> guard(victim.lock);
+    if(!victim.configs.empty()){
+      config.swap(victim.configs.front());
+      victim.configs.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+bool configurationHalts(const Simulator& sim, const vector<long>& config){
+  for(int i=0;i<config.size();i++){
+    uint64_t mask;
+    if(applicableRules(sim, i, config[i], mask)){
+      if(mask != 0) return false;
+      continue;
+    }
+    for(long j=sim.neuron_rules.offsets[i];j<sim.neuron_rules.offsets[i+1];j++){
+      if(ruleApplicable(sim, sim.neuron_rules.targets[j], config[i])){
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+//Expands one configuration: every neuron with applicable rules must fire one
+//of them, so the successors are the product of the per neuron choices.
+//Successors not seen before are added to the worker's next level
+void expandConfiguration(const Simulator& sim, ConfigSet& explored, const vector<long>& config,
+                         ExploreLevel& level){
+  if(configurationHalts(sim, config)){
+    level.halting++;
+    return;
+  }
+  vector<int> choice_neurons;
+  vector<vector<int> > choices;
+  vector<int> spiking(config.size(), -1);
+  for(int i=0;i<config.size();i++){
+    vector<int> applicable;
+    uint64_t mask;
+    if(applicableRules(sim, i, config[i], mask)){
+      for(;mask!=0;mask&=mask-1){
+        applicable.push_back(sim.neuron_rules.targets[sim.neuron_rules.offsets[i] + __builtin_ctzll(mask)]);
+      }
+    } else {
+      for(long j=sim.neuron_rules.offsets[i];j<sim.neuron_rules.offsets[i+1];j++){
+        if(ruleApplicable(sim, sim.neuron_rules.targets[j], config[i])){
+          applicable.push_back(sim.neuron_rules.targets[j]);
+        }
+      }
+    }
+    if(applicable.size() == 1){
+      spiking[i] = applicable[0];
+    } else if(applicable.size() > 1){
+      choice_neurons.push_back(i);
+      choices.push_back(applicable);
+    }
+  }
+  vector<int> digits(choices.size(), 0);
+  vector<long> next(config.size());
+  vector<long> emitted(config.size());
+  while(true){
+    for(int i=0;i<choices.size();i++){
+      spiking[choice_neurons[i]] = choices[i][digits[i]];
+    }
+    emitSpikes(sim, spiking, emitted, 0, config.size());
+    applyTransition(sim, config, spiking, emitted, next, 0, config.size());
+    if(insertConfiguration(explored, next)){
+      level.configs.push_back(next);
+    }
+    int i = 0;
+    while(i < digits.size() && ++digits[i] == choices[i].size()){
+      digits[i++] = 0;
+    }
+    if(i == digits.size()){
+      break;
+    }
+  }
+}
+
+//Explores every configuration reachable within snpsystem.simulationsteps
+//steps breadth first, one level at a time. Each level is spread over per
+//worker deques and workers steal from each other when theirs run dry.
+//Prints the number of new configurations per level, the total reachable and
+//how many of them halt
+void exploreSNP(){
+  Simulator sim;
+  buildSimulator(sim);
+  int threads = thread_pool.workers.size()+1;
+  ConfigSet explored;
+  vector<WorkDeque> deques(threads);
+  vector<ExploreLevel> levels(threads);
+  vector<vector<long> > frontier(1, sim.config);
+  insertConfiguration(explored, sim.config);
+  long reachable = 1;
+  long halting = 0;
+
+  function<void(long, long)> work = [&](long begin, long end){
+    for(long worker=begin;worker<end;worker++){
+      vector<long> config;
+      while(takeConfiguration(deques, worker, config)){
+        expandConfiguration(sim, explored, config, levels[worker]);
+      }
+    }
+  };
+
+  for(int depth=0;!frontier.empty();depth++){
+    cout << depth << ": " << frontier.size() << '\n';
+    if(depth == snpsystem.simulationsteps){
+      break;
+    }
+    for(long i=0;i<frontier.size();i++){
+      deques[i % threads].configs.push_back(vector<long>());
+      deques[i % threads].configs.back().swap(frontier[i]);
+    }
+    frontier.clear();
+    dispatchJob(threads, 1, work);
+    for(int i=0;i<threads;i++){
+      halting += levels[i].halting;
+      levels[i].halting = 0;
+      for(long j=0;j<levels[i].configs.size();j++){
+        frontier.push_back(vector<long>());
+        frontier.back().swap(levels[i].configs[j]);
+      }
+      levels[i].configs.clear();
+    }
+    reachable += frontier.size();
+  }
+  //Configurations on the last level were not expanded, count those that halt
+  for(long i=0;i<frontier.size();i++){
+    if(configurationHalts(sim, frontier[i])){
+      halting++;
+    }
+  }
+
+  cout << "reachable: " << reachable << '\n';
+  cout << "halting: " << halting << '\n';
+  cout.flush();
+}
+
+//Reads the initial configurations of a batch file, one per line, each
+//starting from the parsed one: a count sets the next neuron in declaration
+//order and LABEL=COUNT sets the neurons of a label. Counts may be separated
+//by commas, # starts a comment and lines with no counts are skipped
+//returns false, after printing why on stderr, if the file cannot be read, a
+//count is not a number or a label is not a neuron
+bool readBatch(const char *filename, vector<vector<long> >& configs){
+  ifstream in(filename);
+  if(!in){
+    cerr << "cannot read " << filename << "\n";
+    return false;
+  }
+  string line;
+  for(int number=1;getline(in, line);number++){
+    line = line.substr(0, line.find('#'));
+    replace(line.begin(), line.end(), ',', ' ');
+    istringstream tokens(line);
+    string token;
+    vector<long> config(snpsystem.spikes.begin(), snpsystem.spikes.end());
+    long next = 0;
+    bool counts = false;
+    while(tokens >> token){
+      size_t equals = token.find('=');
+      string value = equals == string::npos ? token : token.substr(equals+1);
+      if(value.empty() || !is_number(value)){
+        cerr << filename << ":" << number << ": " << token << " is not a spike count\n";
+        return false;
+      }
+      if(equals == string::npos){
+        if(next >= config.size()){
+          cerr << filename << ":" << number << ": more counts than neurons\n";
+          return false;
+        }
+        config[next++] = stol(value);
+      } else {
+        int id = findNeuron(token.substr(0, equals));
+        if(id < 0){
+          cerr << filename << ":" << number << ": no neuron " << token.substr(0, equals) << "\n";
+          return false;
+        }
+        for(;id>=0;id=snpsystem.next_same_label[id]){
+          config[id] = stol(value);
+        }
+      }
+      counts = true;
+    }
+    if(counts){
+      configs.push_back(config);
+    }
+  }
+  return true;
+}
+
+//Neurons a batch reports: those of the comma separated labels of --outputs,
+//or else every neuron without synapses to other neurons
+//returns false, after printing it on stderr, if a label is not a neuron
+bool batchOutputs(const Simulator& sim, const char *labels, vector<int>& outputs){
+  if(labels == NULL){
+    vector<bool> feeds(sim.config.size(), false);
+    for(long r=0;r<sim.incoming.targets.size();r++){
+      for(int j=0;j<sim.run_lengths[r];j++){
+        feeds[sim.incoming.targets[r]+j] = true;
+      }
+    }
+    for(int i=0;i<feeds.size();i++){
+      if(!feeds[i]) outputs.push_back(i);
+    }
+    return true;
+  }
+  istringstream in(labels);
+  string label;
+  while(getline(in, label, ',')){
+    int id = findNeuron(label);
+    if(id < 0){
+      cerr << "--outputs: no neuron " << label << "\n";
+      return false;
+    }
+    for(;id>=0;id=snpsystem.next_same_label[id]){
+      outputs.push_back(id);
+    }
+  }
+  return true;
+}
+
+//One step of BATCH_LANES configurations at once. Lanes are interleaved
+//neuron by neuron, config[i*BATCH_LANES + k] being the spikes of neuron i in
+//lane k, so the emitted spikes of a run of source neurons are one contiguous
+//block for all lanes
+//returns false if no rule is applicable in any lane
+bool stepLanes(const Simulator& sim, const long *config, long *emitted, long *next){
+  long neuron_count = sim.config.size();
+  bool fired = false;
+  for(long i=0;i<neuron_count*BATCH_LANES;i++){
+    long spikes = config[i];
+    int rule = firstApplicableRule(sim, i / BATCH_LANES, spikes);
+    emitted[i] = 0;
+    if(rule >= 0){
+      spikes -= sim.rule_c[rule] == CONSUME_ALL ? spikes : sim.rule_c[rule];
+      emitted[i] = sim.rule_p[rule];
+      fired = true;
+    }
+    next[i] = spikes;
+  }
+  if(!fired){
+    return false;
+  }
+  if(sim.avx2){
+    accumulateLanesAvx2(sim, emitted, next);
+  } else {
+    accumulateLanesScalar(sim, emitted, next);
+  }
+  return true;
+}
+
+//Adds to every neuron of every lane what its input runs emit
+void accumulateLanesScalar(const Simulator& sim, const long *emitted, long *next){
+  long neuron_count = sim.config.size();
+  for(long i=0;i<neuron_count;i++){
+    long spikes[BATCH_LANES] = {0};
+    for(long r=sim.incoming.offsets[i];r<sim.incoming.offsets[i+1];r++){
+      const long *source = emitted + (long)sim.incoming.targets[r]*BATCH_LANES;
+      for(long j=0;j<sim.run_lengths[r]*BATCH_LANES;j++){
+        spikes[j % BATCH_LANES] += source[j];
+      }
+    }
+    for(int k=0;k<BATCH_LANES;k++){
+      next[i*BATCH_LANES + k] += spikes[k];
+    }
+  }
+}
+
+//accumulateLanesScalar with the four lanes of a source neuron in one
+//register, so every lane is summed without a horizontal reduction
+#ifdef SNP_AVX2_KERNEL
+__attribute__((target("avx2")))
+void accumulateLanesAvx2(const Simulator& sim, const long *emitted, long *next){
+  long neuron_count = sim.config.size();
+  for(long i=0;i<neuron_count;i++){
+    __m256i sum0 = _mm256_setzero_si256();
+    __m256i sum1 = _mm256_setzero_si256();
+    for(long r=sim.incoming.offsets[i];r<sim.incoming.offsets[i+1];r++){
+      const long *source = emitted + (long)sim.incoming.targets[r]*BATCH_LANES;
+      int length = sim.run_lengths[r];
+      int j = 0;
+      for(;j+2<=length;j+=2){
+        sum0 = _mm256_add_epi64(sum0, _mm256_loadu_si256((const __m256i*)(source + j*BATCH_LANES)));
+        sum1 = _mm256_add_epi64(sum1, _mm256_loadu_si256((const __m256i*)(source + (j+1)*BATCH_LANES)));
+      }
+      if(j < length){
+        sum0 = _mm256_add_epi64(sum0, _mm256_loadu_si256((const __m256i*)(source + j*BATCH_LANES)));
+      }
+    }
+    __m256i *lanes = (__m256i*)(next + i*BATCH_LANES);
+    _mm256_storeu_si256(lanes, _mm256_add_epi64(_mm256_loadu_si256(lanes), _mm256_add_epi64(sum0, sum1)));
+  }
+}
+#else
+void accumulateLanesAvx2(const Simulator& sim, const long *emitted, long *next){
+  accumulateLanesScalar(sim, emitted, next);
+}
+#endif
+
+//Simulates every configuration of a batch file (--batch) through the parsed
+//system like simulateSNP, and prints the spikes of the output neurons each
+//one halts with or has after snpsystem.simulationsteps steps, one line per
+//configuration in file order. Configurations are stepped BATCH_LANES at a
+//time, a lane that halts stays as it is until the others do, and groups of
+//lanes are spread over the threads
+//returns false, after printing why on stderr, if the batch file or the
+//output labels cannot be read
+bool simulateBatch(const char *batch_file, const char *output_labels){
+  Simulator sim;
+  buildSimulator(sim);
+  vector<vector<long> > configs;
+  vector<int> outputs;
+  if(!readBatch(batch_file, configs) || !batchOutputs(sim, output_labels, outputs)){
+    return false;
+  }
+  long neuron_count = sim.config.size();
+  long input_count = configs.size();
+  vector<long> results(input_count*outputs.size());
+
+  function<void(long, long)> run = [&](long begin, long end){
+    vector<long> config(neuron_count*BATCH_LANES);
+    vector<long> next(neuron_count*BATCH_LANES);
+    vector<long> emitted(neuron_count*BATCH_LANES);
+    for(long group=begin;group<end;group++){
+      //Lanes past the last configuration repeat it
+      for(int k=0;k<BATCH_LANES;k++){
+        const vector<long>& input = configs[min(group*BATCH_LANES + k, input_count-1)];
+        for(long i=0;i<neuron_count;i++){
+          config[i*BATCH_LANES + k] = input[i];
+        }
+      }
+      for(int step=1;step<=snpsystem.simulationsteps;step++){
+        if(!stepLanes(sim, config.data(), emitted.data(), next.data())){
+          break;
+        }
+        config.swap(next);
+      }
+      for(int k=0;k<BATCH_LANES && group*BATCH_LANES + k < input_count;k++){
+        long *result = &results[(group*BATCH_LANES + k)*outputs.size()];
+        for(int o=0;o<outputs.size();o++){
+          result[o] = config[outputs[o]*BATCH_LANES + k];
+        }
+      }
+    }
+  };
+  dispatchJob((input_count + BATCH_LANES - 1) / BATCH_LANES, 1, run);
+
+  for(long i=0;i<input_count;i++){
+    cout << i << ":";
+    for(int o=0;o<outputs.size();o++){
+      cout << " " << results[i*outputs.size() + o];
+    }
+    cout << '\n';
+  }
+  cout.flush();
+  return true;
+}
+
+void printRange(Range r){
   cout << r.x1;
   if(r.inclusive_x1){
     cout << ":<=:";
@@ -1319,16 +4428,374 @@ void printRange(Range r){
   cout << r.x2 << endl;
 }
 
-void printTraverseTree(TreeNode root){
-  cout << "Tree:" << root.label << ":" << root.value << endl;
-  for(int i=0;i<root.children.size();i++){
-    printTraverseTree(root.children[i]);
-  }
-}
-
 void check(string r){
   cout << "=================<" << r << ">" << endl;
 }
 void check(){
   cout << "=================" << endl;
 }
+
+//Turns on --stats: counters start being bumped and cout is routed through
+//stdout_counter so the CuSNP output can be measured
+void enableStats(){
+  stats.enabled = true;
+  stdout_counter.target = cout.rdbuf();
+  cout.rdbuf(&stdout_counter);
+}
+
+void recordPhase(const string& name, chrono::steady_clock::time_point start){
+  if(!stats.enabled){
+    return;
+  }
+  stats.phase_names.push_back(name);
+  stats.phase_seconds.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+}
+
+//Prints the phase times and counters to stderr, stdout only carries CuSNP
+void printStats(){
+  if(!stats.enabled){
+    return;
+  }
+  cout.flush();
+  cout.rdbuf(stdout_counter.target);
+  stats.bytes_written += stdout_counter.bytes;
+  for(int i=0;i<stats.phase_names.size();i++){
+    cerr << "phase " << stats.phase_names[i] << ": " << stats.phase_seconds[i] << " s\n";
+  }
+  cerr << "evalMathExp calls: " << stats.mathexp_evals.load() << "\n";
+  cerr << "labels rendered: " << stats.label_renders.load() << "\n";
+  cerr << "range leaves: " << stats.range_leaves.load() << "\n";
+  cerr << "neurons created: " << stats.neurons << "\n";
+  cerr << "rules created: " << stats.rules << "\n";
+  cerr << "synapses created: " << stats.synapses << "\n";
+  cerr << "bytes written: " << stats.bytes_written << "\n";
+}
+
+//FNV-1a
+uint64_t hashBytes(const void *data, size_t size, uint64_t hash){
+  const unsigned char *bytes = (const unsigned char*)data;
+  for(size_t i=0;i<size;i++){
+    hash = (hash ^ bytes[i]) * FNV_PRIME;
+  }
+  return hash;
+}
+
+string cacheKey(uint64_t hash){
+  char key[17];
+  snprintf(key, sizeof(key), "%016llx", (unsigned long long)hash);
+  return key;
+}
+
+//Hashes the kind and text of a token range, so layout changes that do not
+//change the tokens keep the hash
+uint64_t hashTokens(const Parser& parser, size_t begin, size_t end){
+  uint64_t hash = FNV_OFFSET;
+  for(size_t i=begin;i<end;i++){
+    const Token& token = parser.tokens[i];
+    hash = hashBytes(&token.kind, sizeof(token.kind), hash);
+    hash = hashBytes(token.text.data(), token.text.size(), hash);
+    hash = hashBytes("", 1, hash);
+  }
+  return hash;
+}
+
+//Gives every def a hash covering its own tokens and those of every def it
+//can reach through calls, so editing a def changes the hash of its callers
+void hashMethods(){
+  for(int i=0;i<methods.size();i++){
+    vector<char> reached(methods.size(), 0);
+    vector<int> pending(1, i);
+    vector<uint64_t> hashes;
+    reached[i] = 1;
+    while(!pending.empty()){
+      int method = pending.back();
+      pending.pop_back();
+      if(method != i){
+        hashes.push_back(methods[method].source_hash);
+      }
+      for(int j=0;j<methods[method].body.size();j++){
+        int callee = methods[method].body[j].callee;
+        if(callee >= 0 && !reached[callee]){
+          reached[callee] = 1;
+          pending.push_back(callee);
+        }
+      }
+    }
+    sort(hashes.begin(), hashes.end());
+    uint64_t hash = hashBytes(&methods[i].source_hash, sizeof(uint64_t), FNV_OFFSET);
+    methods[i].hash = hashBytes(hashes.data(), hashes.size()*sizeof(uint64_t), hash);
+  }
+}
+
+//Where a cache file is written before being renamed into place
+string tempPath(const string& path){
+  return path + ".tmp" + to_string(getpid());
+}
+
+//Sets up --cache DIR. Outputs are keyed by the input file, -s and the output
+//format, fragments by the called def, the defs it reaches and the arguments.
+//Ranged statements recorded for --blocks cannot be replayed, so --blocks only
+//caches whole outputs
+void openCompileCache(const char *dir, const char *filename, int steps, const char *binary_output,
+                      const char *blocks_output, bool rule_sets, bool cache_output){
+  mkdir(dir, 0755);
+  compile_cache.dir = dir;
+  compile_cache.fragments = !families.enabled;
+  SourceFile source;
+  if(!cache_output || !mapSource(filename, source)){
+    return;
+  }
+  const char *format = binary_output != NULL ? ".bin" : blocks_output != NULL ? ".blk" :
+                       rule_sets ? ".sets.txt" : ".txt";
+  uint64_t hash = hashBytes(CACHE_VERSION, strlen(CACHE_VERSION), FNV_OFFSET);
+  hash = hashBytes(source.data, source.size, hash);
+  hash = hashBytes(&steps, sizeof(steps), hash);
+  hash = hashBytes(format, strlen(format), hash);
+  unmapSource(source);
+  compile_cache.output = compile_cache.dir + "/out-" + cacheKey(hash) + format;
+}
+
+//Writes the cached output of this run where it was asked for
+//returns false if it is not in the cache
+bool useCachedOutput(const char *binary_output, const char *blocks_output){
+  if(compile_cache.output.empty()){
+    return false;
+  }
+  if(binary_output != NULL || blocks_output != NULL){
+    return copyFile(compile_cache.output, binary_output != NULL ? binary_output : blocks_output);
+  }
+  ifstream cached(compile_cache.output.c_str(), ios::binary);
+  if(!cached || cached.peek() == EOF){
+    return false;
+  }
+  cout << cached.rdbuf();
+  cout.flush();
+  return true;
+}
+
+//Sends text output to a file in the cache, storeCachedOutput then prints it
+void captureOutput(const char *binary_output, const char *blocks_output){
+  if(compile_cache.output.empty() || binary_output != NULL || blocks_output != NULL){
+    return;
+  }
+  compile_cache.capture.open(tempPath(compile_cache.output).c_str(), ios::binary);
+  if(compile_cache.capture){
+    compile_cache.stdout_buffer = cout.rdbuf(compile_cache.capture.rdbuf());
+  }
+}
+
+void storeCachedOutput(const char *binary_output, const char *blocks_output){
+  if(compile_cache.output.empty()){
+    return;
+  }
+  string temp = tempPath(compile_cache.output);
+  if(compile_cache.stdout_buffer != NULL){
+    cout.flush();
+    cout.rdbuf(compile_cache.stdout_buffer);
+    compile_cache.stdout_buffer = NULL;
+    compile_cache.capture.close();
+    string written = rename(temp.c_str(), compile_cache.output.c_str()) == 0 ? compile_cache.output : temp;
+    ifstream cached(written.c_str(), ios::binary);
+    if(cached.peek() != EOF){
+      cout << cached.rdbuf();
+    }
+    cout.flush();
+    remove(temp.c_str());
+  } else if(binary_output != NULL || blocks_output != NULL){
+    if(copyFile(binary_output != NULL ? binary_output : blocks_output, temp)){
+      rename(temp.c_str(), compile_cache.output.c_str());
+    }
+    remove(temp.c_str());
+  }
+}
+
+bool copyFile(const string& from, const string& to){
+  ifstream in(from.c_str(), ios::binary);
+  if(!in){
+    return false;
+  }
+  ofstream out(to.c_str(), ios::binary);
+  if(in.peek() != EOF){
+    out << in.rdbuf();
+  }
+  return (bool)out;
+}
+
+//Replays a call made by main from its cached fragment, or runs it while
+//recording what it adds to the system. Small fragments are not kept, they
+//cost less to expand again than to read back
+void runCachedCall(const MethodHolder& method, const Environment& frame){
+  uint64_t hash = hashBytes(CACHE_VERSION, strlen(CACHE_VERSION), FNV_OFFSET);
+  hash = hashBytes(&method.hash, sizeof(method.hash), hash);
+  hash = hashBytes(&snpsystem.rule_sets, sizeof(snpsystem.rule_sets), hash);
+  hash = hashBytes(frame.values.data(), frame.values.size()*sizeof(int), hash);
+  string path = compile_cache.dir + "/frag-" + cacheKey(hash);
+  if(replayFragment(path)){
+    return;
+  }
+  compile_cache.recording = true;
+  compile_cache.fragment.temp_path = tempPath(path);
+  runMethod(method, frame);
+  compile_cache.recording = false;
+  finishFragment(path);
+  compile_cache.fragment = Fragment();
+}
+
+//Index of a string in the fragment's table, adding it on first use
+int fragmentString(string_view str){
+  Fragment& fragment = compile_cache.fragment;
+  pair<unordered_map<string, int>::iterator, bool> entry =
+      fragment.string_ids.emplace(string(str), fragment.strings.size());
+  if(entry.second){
+    fragment.strings.push_back(string(str));
+  }
+  return entry.first->second;
+}
+
+void recordOp(initializer_list<int> op){
+  Fragment& fragment = compile_cache.fragment;
+  fragment.ops.insert(fragment.ops.end(), op);
+  fragment.op_ints += op.size();
+  if(fragment.ops.size() >= FRAGMENT_BUFFER){
+    flushFragment();
+  }
+}
+
+//Moves the buffered ops to the fragment's temporary file, opening it and
+//leaving room for the header on first use. The file is given up on error
+void flushFragment(){
+  Fragment& fragment = compile_cache.fragment;
+  if(fragment.file == NULL && !fragment.temp_path.empty()){
+    fragment.file = fopen(fragment.temp_path.c_str(), "wb");
+    fragment.temp_path = fragment.file != NULL ? fragment.temp_path : "";
+    uint64_t counts[2] = {0, 0};
+    if(fragment.file != NULL){
+      fwrite(FRAGMENT_MAGIC, 1, sizeof(FRAGMENT_MAGIC), fragment.file);
+      fwrite(counts, sizeof(uint64_t), 2, fragment.file);
+    }
+  }
+  if(fragment.file != NULL){
+    fwrite(fragment.ops.data(), sizeof(int), fragment.ops.size(), fragment.file);
+  }
+  fragment.ops.clear();
+}
+
+//Completes a recorded fragment and moves it into place
+//  magic, op int count, string count, ops, then each string as length and bytes
+void finishFragment(const string& path){
+  Fragment& fragment = compile_cache.fragment;
+  if(fragment.op_ints < FRAGMENT_MIN_INTS){
+    return;
+  }
+  flushFragment();
+  if(fragment.file == NULL){
+    return;
+  }
+  for(int i=0;i<fragment.strings.size();i++){
+    uint32_t length = fragment.strings[i].length();
+    fwrite(&length, sizeof(length), 1, fragment.file);
+    fwrite(fragment.strings[i].data(), 1, length, fragment.file);
+  }
+  uint64_t counts[2] = {(uint64_t)fragment.op_ints, (uint64_t)fragment.strings.size()};
+  fseek(fragment.file, sizeof(FRAGMENT_MAGIC), SEEK_SET);
+  fwrite(counts, sizeof(uint64_t), 2, fragment.file);
+  bool written = !ferror(fragment.file);
+  if(fclose(fragment.file) == 0 && written){
+    rename(fragment.temp_path.c_str(), path.c_str());
+  }
+  fragment.file = NULL;
+  remove(fragment.temp_path.c_str());
+}
+
+//Applies a cached fragment to the system. The ops are checked in a first
+//pass and applied in a second, so a damaged file changes nothing
+//returns false if there is no usable fragment
+bool replayFragment(const string& path){
+  FILE *file = fopen(path.c_str(), "rb");
+  if(file == NULL){
+    return false;
+  }
+  char magic[sizeof(FRAGMENT_MAGIC)];
+  uint64_t counts[2];
+  long ops_at = sizeof(magic) + sizeof(counts);
+  bool valid = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+               memcmp(magic, FRAGMENT_MAGIC, sizeof(magic)) == 0 &&
+               fread(counts, sizeof(uint64_t), 2, file) == 2 &&
+               fseek(file, ops_at + counts[0]*sizeof(int), SEEK_SET) == 0;
+  vector<string> strings;
+  for(uint64_t i=0;valid && i<counts[1];i++){
+    uint32_t length;
+    valid = fread(&length, sizeof(length), 1, file) == 1;
+    strings.push_back(string(valid ? length : 0, '\0'));
+    valid = valid && (length == 0 || fread(&strings.back()[0], 1, length, file) == length);
+  }
+
+  vector<int> label_ids(strings.size(), -1);
+  vector<int> regex_ids(strings.size(), -1);
+  vector<int> buffer(FRAGMENT_BUFFER);
+  int op[6];
+  for(int pass=0;valid && pass<2;pass++){
+    fseek(file, ops_at, SEEK_SET);
+    uint64_t remaining = counts[0];
+    size_t have = 0, at = 0;
+    while(valid && (remaining > 0 || at < have)){
+      for(int i=0;valid && i<FRAG_OP_INTS[i == 0 ? 0 : op[0]];i++){
+        if(at == have){
+          have = fread(buffer.data(), sizeof(int), min((uint64_t)buffer.size(), remaining), file);
+          remaining -= have;
+          at = 0;
+        }
+        valid = at < have;
+        op[i] = valid ? buffer[at++] : 0;
+        valid = valid && (i > 0 || (op[0] >= 0 && op[0] < FRAG_OP_COUNT));
+      }
+      if(!valid){
+        break;
+      }
+      //Every op names a string first, a rule its regex second
+      if(pass == 0){
+        valid = op[0] == FRAG_CLEAR || (op[1] >= 0 && op[1] < strings.size());
+        valid = valid && ((op[0] != FRAG_RULE && op[0] != FRAG_SYNAPSE) || (op[2] >= 0 && op[2] < strings.size()));
+        continue;
+      }
+      if(op[0] == FRAG_CLEAR){
+        clearNeurons();
+        continue;
+      }
+      int& label = label_ids[op[1]];
+      if(label < 0){
+        label = internLabel(strings[op[1]]);
+      }
+      if(op[0] == FRAG_NEURON){
+        addNeuron(label);
+      } else if(op[0] == FRAG_RULE){
+        int& regex = regex_ids[op[2]];
+        if(regex < 0){
+          regex = internString(snpsystem.regexes, strings[op[2]]);
+        }
+        Rule rule;
+        rule.neuron_label = label;
+        rule.regex = regex;
+        rule.c = op[3];
+        rule.p = op[4];
+        rule.d = op[5];
+        addRule(rule);
+      } else if(op[0] == FRAG_SYNAPSE){
+        int& to = label_ids[op[2]];
+        if(to < 0){
+          to = internLabel(strings[op[2]]);
+        }
+        Synapse syn;
+        syn.from = label;
+        syn.to = to;
+        addSynapse(syn);
+      } else if(op[0] == FRAG_SET_SPIKE){
+        setSpike(strings[op[1]], op[2]);
+      } else {
+        addSpike(strings[op[1]], op[2]);
+      }
+    }
+  }
+  fclose(file);
+  return valid;
+}
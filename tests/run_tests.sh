@@ -0,0 +1,53 @@
+#!/bin/bash
+# Regression checks for snp_pli_parser
+#
+#   g++ -O2 -pthread -o snp_pli_parser snp_pli_parser.cpp
+#   tests/run_tests.sh [./snp_pli_parser]
+
+PARSER=$(realpath "${1:-./snp_pli_parser}")
+DIR=$(dirname "$0")
+TMP=$(mktemp -d)
+fail=0
+
+# --blocks output expands back to the text output
+for pli in "$DIR"/blocks_*.pli; do
+  if ! "$PARSER" "$pli" --blocks "$TMP/out.blk" ||
+     ! "$PARSER" --expand-blocks "$TMP/out.blk" > "$TMP/expanded.txt" ||
+     ! "$PARSER" "$pli" | cmp -s - "$TMP/expanded.txt"; then
+    echo "FAIL: $pli"
+    fail=1
+  fi
+done
+
+# --binary output and --to-binary of the text output both convert back to it
+for pli in "$DIR"/binary_*.pli; do
+  if ! "$PARSER" "$pli" > "$TMP/out.txt" ||
+     ! "$PARSER" "$pli" --binary "$TMP/out.bin" ||
+     ! "$PARSER" --to-text "$TMP/out.bin" | cmp -s - "$TMP/out.txt" ||
+     ! "$PARSER" --to-binary "$TMP/out.txt" "$TMP/text.bin" ||
+     ! "$PARSER" --to-text "$TMP/text.bin" | cmp -s - "$TMP/out.txt"; then
+    echo "FAIL: $pli"
+    fail=1
+  fi
+done
+
+# --simulate -s 10 prints the configurations in the matching .out file
+for pli in "$DIR"/simulate_*.pli; do
+  if ! "$PARSER" "$pli" --simulate -s 10 | cmp -s - "${pli%.pli}.out"; then
+    echo "FAIL: $pli"
+    fail=1
+  fi
+done
+
+# Rule regexes compile to canonical unions of progressions: (a4)*|(aa)*,
+# a2|(aa)* and a3(a6)*|a(aa)* to one each, (a3)+|(a6)* to two.
+# progression_count is at byte 104 of the binary header
+if ! "$PARSER" "$DIR/progressions_canonical.pli" --binary "$TMP/out.bin" ||
+   [ "$(od -An -t u8 -j 104 -N 8 "$TMP/out.bin" | tr -d ' ')" != 5 ]; then
+  echo "FAIL: $DIR/progressions_canonical.pli"
+  fail=1
+fi
+
+rm -rf "$TMP"
+[ $fail = 0 ] && echo "all tests passed"
+exit $fail